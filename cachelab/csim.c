@@ -6,14 +6,7 @@
 #include <unistd.h>
 
 #include "cachelab.h"
-
-typedef u_int8_t u8;
-typedef u_int64_t u64;
-
-typedef struct Line {
-    u64 tag;
-    u64 usage;
-} Line;
+#include "csim.h"
 
 void line_init(Line* line, int block_bytes)
 {
@@ -21,12 +14,6 @@ void line_init(Line* line, int block_bytes)
     line->usage = 0;
 }
 
-typedef struct Set {
-    int used_lines;
-    int access_count; // for LRU
-    Line* lines;
-} Set;
-
 void set_init(Set* set, int lines, int block_bytes)
 {
     set->lines = (Line*)malloc(sizeof(Line) * lines);
@@ -37,10 +24,6 @@ void set_init(Set* set, int lines, int block_bytes)
     }
 }
 
-typedef struct Cache {
-    Set* sets;
-} Cache;
-
 Cache*
 cache_init(int sets, int lines, int block_bytes)
 {
@@ -65,19 +48,30 @@ void cache_dispose(Cache* cache, int sets, int lines)
     free(cache);
 }
 
-typedef struct CacheInfo {
-    int lines;
-    u64 set_mask;
-    u64 block_mask;
-    int block_bits;
-    int set_bits;
-} CacheInfo;
+CacheInfo cache_info_init(int set_bits, int lines, int block_bits)
+{
+    u64 block_mask = 0;
+    u64 set_mask = 0;
 
-typedef struct Results {
-    int hits;
-    int misses;
-    int evictions;
-} Results;
+    for (int i = 0; i < block_bits; i++) {
+        block_mask <<= 1;
+        block_mask |= 1;
+    }
+
+    for (int i = 0; i < set_bits; i++) {
+        set_mask <<= 1;
+        set_mask |= 1;
+    }
+
+    CacheInfo ci = { .lines = lines,
+        .block_mask = block_mask,
+        .set_mask = set_mask,
+        .block_bits = block_bits,
+        .set_bits = set_bits,
+        .verbose = 0 };
+
+    return ci;
+}
 
 void process_address(
     u64 addr,
@@ -93,7 +87,9 @@ void process_address(
     Set* set = &cache->sets[set_index];
     set->access_count++;
 
-    printf("%c %lx,%d ", access, addr, size);
+    if (ci->verbose) {
+        printf("%c %lx,%d ", access, addr, size);
+    }
 
     for (int l = 0; l < set->used_lines; l++) {
         Line* line = &set->lines[l];
@@ -101,17 +97,21 @@ void process_address(
         if (line->tag == tag) {
             line->usage = set->access_count;
             res->hits += 1;
-            printf("hit \n");
 
             if (access == 'M') {
-                printf("hit ");
                 res->hits += 1;
             }
+
+            if (ci->verbose) {
+                printf(access == 'M' ? "hit hit \n" : "hit \n");
+            }
             return;
         }
     }
 
-    printf("miss ");
+    if (ci->verbose) {
+        printf("miss ");
+    }
 
     if (set->used_lines < ci->lines) {
         set->lines[set->used_lines].tag = tag;
@@ -131,18 +131,43 @@ void process_address(
         set->lines[lru].tag = tag;
         set->lines[lru].usage = set->access_count;
 
+        if (ci->verbose) {
+            printf("eviction ");
+        }
+
         res->evictions += 1;
         res->misses += 1;
     }
 
     if (access == 'M') {
-        printf("hit ");
         res->hits += 1;
     }
 
-    printf("\n");
+    if (ci->verbose) {
+        printf(access == 'M' ? "hit \n" : "\n");
+    }
+}
+
+/*
+    Batch path - used by in-process tracers (see trace-trans.c),
+    which hand over whole buffers of references instead of a text trace
+*/
+void process_batch(
+    const Access* batch,
+    size_t count,
+    Cache* cache,
+    CacheInfo* ci,
+    Results* res)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (batch[i].access == 'I') {
+            continue;
+        }
+        process_address(batch[i].addr, batch[i].access, batch[i].size, cache, ci, res);
+    }
 }
 
+#ifndef CSIM_NO_MAIN
 int main(int argc, char** argv)
 {
     /*
@@ -152,10 +177,14 @@ int main(int argc, char** argv)
     int set_bits = 0;
     int lines = 0;
     int block_bits = 0;
+    int verbose = 0;
     char* tracefile;
 
-    while ((c = getopt(argc, argv, "s:E:b:t:")) != -1) {
+    while ((c = getopt(argc, argv, "vs:E:b:t:")) != -1) {
         switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
         case 's':
             set_bits = atoi(optarg);
             break;
@@ -178,24 +207,8 @@ int main(int argc, char** argv)
     int block_bytes = pow(2, block_bits);
     Cache* cache = cache_init(sets, lines, block_bytes);
 
-    u64 block_mask = 0;
-    u64 set_mask = 0;
-
-    for (int i = 0; i < block_bits; i++) {
-        block_mask <<= 1;
-        block_mask |= 1;
-    }
-
-    for (int i = 0; i < set_bits; i++) {
-        set_mask <<= 1;
-        set_mask |= 1;
-    }
-
-    CacheInfo ci = { .lines = lines,
-        .block_mask = block_mask,
-        .set_mask = set_mask,
-        .block_bits = block_bits,
-        .set_bits = set_bits };
+    CacheInfo ci = cache_info_init(set_bits, lines, block_bits);
+    ci.verbose = verbose;
 
     Results res = { .hits = 0, .misses = 0, .evictions = 0 };
 
@@ -222,3 +235,4 @@ int main(int argc, char** argv)
     printSummary(res.hits, res.misses, res.evictions);
     return EXIT_SUCCESS;
 }
+#endif
@@ -0,0 +1,66 @@
+#ifndef CSIM_H
+#define CSIM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef u_int8_t u8;
+typedef u_int64_t u64;
+
+typedef struct Line {
+    u64 tag;
+    u64 usage;
+} Line;
+
+typedef struct Set {
+    int used_lines;
+    int access_count; // for LRU
+    Line* lines;
+} Set;
+
+typedef struct Cache {
+    Set* sets;
+} Cache;
+
+typedef struct CacheInfo {
+    int lines;
+    u64 set_mask;
+    u64 block_mask;
+    int block_bits;
+    int set_bits;
+    int verbose;
+} CacheInfo;
+
+typedef struct Results {
+    int hits;
+    int misses;
+    int evictions;
+} Results;
+
+// One memory reference, the same thing as one line of a valgrind trace
+typedef struct Access {
+    u64 addr;
+    char access;
+    int size;
+} Access;
+
+Cache* cache_init(int sets, int lines, int block_bytes);
+void cache_dispose(Cache* cache, int sets, int lines);
+CacheInfo cache_info_init(int set_bits, int lines, int block_bits);
+
+void process_address(
+    u64 addr,
+    char access,
+    int size,
+    Cache* cache,
+    CacheInfo* ci,
+    Results* res);
+
+void process_batch(
+    const Access* batch,
+    size_t count,
+    Cache* cache,
+    CacheInfo* ci,
+    Results* res);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * trace-trans.c - Score transpose functions without valgrind
+ *
+ * trans.c is compiled with -DTRACE_TRANS, so every A / B access in the
+ * transpose functions calls trace_record(). The references are collected
+ * in a ring buffer, which is drained straight into the simulator batch path
+ * (process_batch in csim.c) whenever it fills up.
+ *
+ * Only the A / B references are recorded. The valgrind trace also contains
+ * the stack traffic of the function (locals, spilled arguments), so test-trans
+ * reports a few more hits and misses (e.g. 287 instead of 284 misses for the
+ * 32 x 32 submission), but the misses caused by A and B are the same.
+ * The stack isn't modelled, its layout depends on how trans.c is compiled.
+ * With -s the misses it cost test-trans on the 32 x 32 submission are added
+ * to every function instead, so the totals can be held against the graded
+ * limits. Hits and evictions are always the A / B ones.
+ *
+ * Build:
+ *     gcc -O2 -DTRACE_TRANS -DCSIM_NO_MAIN -o trace-trans \
+ *         trace-trans.c trans.c csim.c -lm
+ *
+ * Usage: ./trace-trans [-s] [-M cols -N rows]
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cachelab.h"
+#include "csim.h"
+
+// Same cache as the one the transpose functions are graded on
+#define SET_BITS 5
+#define LINES 1
+#define BLOCK_BITS 5
+
+#define RING_SIZE (1 << 12)
+
+// Misses of the stack frame in the valgrind trace, measured with test-trans
+#define STACK_MISSES 3
+
+// Same layout as in tracegen.c, so that the set indices match
+static int A[256][256];
+static int B[256][256];
+
+static trans_func_t func_list[MAX_TRANS_FUNCS];
+static int func_counter = 0;
+static unsigned stack_misses = 0;
+
+int is_transpose(int M, int N, int A[N][M], int B[M][N]);
+void registerFunctions();
+
+void registerTransFunction(void (*trans)(int M, int N, int[N][M], int[M][N]), char* desc)
+{
+    func_list[func_counter].func_ptr = trans;
+    func_list[func_counter].description = desc;
+    func_counter++;
+}
+
+/*
+    Ring buffer of recorded references
+*/
+typedef struct Tracer {
+    Access ring[RING_SIZE];
+    size_t head;
+    Cache* cache;
+    CacheInfo ci;
+    Results res;
+} Tracer;
+
+static Tracer tracer;
+
+static void tracer_drain()
+{
+    process_batch(tracer.ring, tracer.head, tracer.cache, &tracer.ci, &tracer.res);
+    tracer.head = 0;
+}
+
+void trace_record(char access, const void* addr, int size)
+{
+    Access* a = &tracer.ring[tracer.head++];
+    a->addr = (u64)addr;
+    a->access = access;
+    a->size = size;
+
+    if (tracer.head == RING_SIZE) {
+        tracer_drain();
+    }
+}
+
+static void run_func(trans_func_t* func, int M, int N)
+{
+    int sets = 1 << SET_BITS;
+
+    tracer.cache = cache_init(sets, LINES, 1 << BLOCK_BITS);
+    tracer.ci = cache_info_init(SET_BITS, LINES, BLOCK_BITS);
+    tracer.res = (Results) { .hits = 0, .misses = 0, .evictions = 0 };
+    tracer.head = 0;
+
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < M; j++) {
+            ((int*)A)[i * M + j] = rand();
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    (*func->func_ptr)(M, N, (int(*)[M])A, (int(*)[N])B);
+    tracer_drain();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    func->correct = is_transpose(M, N, (int(*)[M])A, (int(*)[N])B);
+    func->num_hits = tracer.res.hits;
+    func->num_misses = tracer.res.misses + stack_misses;
+    func->num_evictions = tracer.res.evictions;
+
+    double us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+
+    printf("%dx%d func (%s): correct:%d hits:%u, misses:%u, evictions:%u, %.1f us\n",
+        M, N, func->description, func->correct, func->num_hits, func->num_misses,
+        func->num_evictions, us);
+
+    cache_dispose(tracer.cache, sets, LINES);
+}
+
+int main(int argc, char** argv)
+{
+    int c;
+    int M = 0;
+    int N = 0;
+
+    while ((c = getopt(argc, argv, "M:N:s")) != -1) {
+        switch (c) {
+        case 's':
+            stack_misses = STACK_MISSES;
+            break;
+        case 'M':
+            M = atoi(optarg);
+            break;
+        case 'N':
+            N = atoi(optarg);
+            break;
+        }
+    }
+
+    if (M < 0 || N < 0 || M > 256 || N > 256) {
+        fprintf(stderr, "matrix dimensions must be between 1 and 256\n");
+        return EXIT_FAILURE;
+    }
+
+    registerFunctions();
+
+    // The three graded cases by default
+    int sizes[3][2] = { { 32, 32 }, { 64, 64 }, { 61, 67 } };
+    int size_count = 3;
+
+    if (M != 0 && N != 0) {
+        sizes[0][0] = M;
+        sizes[0][1] = N;
+        size_count = 1;
+    }
+
+    for (int s = 0; s < size_count; s++) {
+        for (int f = 0; f < func_counter; f++) {
+            run_func(&func_list[f], sizes[s][0], sizes[s][1]);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
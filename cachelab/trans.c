@@ -10,6 +10,21 @@
 #include "cachelab.h"
 #include <stdio.h>
 
+/*
+ * Every access to A and B goes through LD() / ST(). In a normal build they
+ * are plain array accesses, in the instrumented build (-DTRACE_TRANS, see
+ * trace-trans.c) they also record the address, so a function can be scored
+ * without running it under valgrind.
+ */
+#ifdef TRACE_TRANS
+void trace_record(char access, const void* addr, int size);
+#define LD(x) (trace_record('L', &(x), sizeof(x)), (x))
+#define ST(x, v) ((x) = (v), trace_record('S', &(x), sizeof(x)))
+#else
+#define LD(x) (x)
+#define ST(x, v) ((x) = (v))
+#endif
+
 int is_transpose(int M, int N, int A[N][M], int B[M][N]);
 
 /*
@@ -27,23 +42,23 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
             for (int c = 0; c < M; c += 8) { // matrix column
                 for (int br = 0; br < 8; br++) { // block row
                     int _0, _1, _2, _3, _4, _5, _6, _7;
-                    _0 = A[r + br][c + 0];
-                    _1 = A[r + br][c + 1];
-                    _2 = A[r + br][c + 2];
-                    _3 = A[r + br][c + 3];
-                    _4 = A[r + br][c + 4];
-                    _5 = A[r + br][c + 5];
-                    _6 = A[r + br][c + 6];
-                    _7 = A[r + br][c + 7];
-
-                    B[c + 0][r + br] = _0;
-                    B[c + 1][r + br] = _1;
-                    B[c + 2][r + br] = _2;
-                    B[c + 3][r + br] = _3;
-                    B[c + 4][r + br] = _4;
-                    B[c + 5][r + br] = _5;
-                    B[c + 6][r + br] = _6;
-                    B[c + 7][r + br] = _7;
+                    _0 = LD(A[r + br][c + 0]);
+                    _1 = LD(A[r + br][c + 1]);
+                    _2 = LD(A[r + br][c + 2]);
+                    _3 = LD(A[r + br][c + 3]);
+                    _4 = LD(A[r + br][c + 4]);
+                    _5 = LD(A[r + br][c + 5]);
+                    _6 = LD(A[r + br][c + 6]);
+                    _7 = LD(A[r + br][c + 7]);
+
+                    ST(B[c + 0][r + br], _0);
+                    ST(B[c + 1][r + br], _1);
+                    ST(B[c + 2][r + br], _2);
+                    ST(B[c + 3][r + br], _3);
+                    ST(B[c + 4][r + br], _4);
+                    ST(B[c + 5][r + br], _5);
+                    ST(B[c + 6][r + br], _6);
+                    ST(B[c + 7][r + br], _7);
                 }
             }
         }
@@ -55,46 +70,46 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
             for (int c = 0; c < M; c += 8) { // matrix column
                 int _10, _11, _12, _13, _20, _21, _22, _23;
                 for (int ch = 0; ch < 8; ch += 2) { // 2x4 chunk index
-                    _10 = A[r + ch][c + 0];
-                    _11 = A[r + ch][c + 1];
-                    _12 = A[r + ch][c + 2];
-                    _13 = A[r + ch][c + 3];
-                    _20 = A[r + ch + 1][c + 0];
-                    _21 = A[r + ch + 1][c + 1];
-                    _22 = A[r + ch + 1][c + 2];
-                    _23 = A[r + ch + 1][c + 3];
-
-                    B[c + 0][r + ch] = _10;
-                    B[c + 1][r + ch] = _11;
-                    B[c + 2][r + ch] = _12;
-                    B[c + 3][r + ch] = _13;
-                    B[c + 0][r + ch + 1] = _20;
-                    B[c + 1][r + ch + 1] = _21;
-                    B[c + 2][r + ch + 1] = _22;
-                    B[c + 3][r + ch + 1] = _23;
+                    _10 = LD(A[r + ch][c + 0]);
+                    _11 = LD(A[r + ch][c + 1]);
+                    _12 = LD(A[r + ch][c + 2]);
+                    _13 = LD(A[r + ch][c + 3]);
+                    _20 = LD(A[r + ch + 1][c + 0]);
+                    _21 = LD(A[r + ch + 1][c + 1]);
+                    _22 = LD(A[r + ch + 1][c + 2]);
+                    _23 = LD(A[r + ch + 1][c + 3]);
+
+                    ST(B[c + 0][r + ch], _10);
+                    ST(B[c + 1][r + ch], _11);
+                    ST(B[c + 2][r + ch], _12);
+                    ST(B[c + 3][r + ch], _13);
+                    ST(B[c + 0][r + ch + 1], _20);
+                    ST(B[c + 1][r + ch + 1], _21);
+                    ST(B[c + 2][r + ch + 1], _22);
+                    ST(B[c + 3][r + ch + 1], _23);
                 }
 
                 c += 4; // Switch to next column of 2x4 ints, we can't introduce another declaration here
                     //as per rules of the assignment
 
                 for (int ch = 0; ch < 8; ch += 2) { // 2x4 chunk index
-                    _10 = A[r + ch][c + 0];
-                    _11 = A[r + ch][c + 1];
-                    _12 = A[r + ch][c + 2];
-                    _13 = A[r + ch][c + 3];
-                    _20 = A[r + ch + 1][c + 0];
-                    _21 = A[r + ch + 1][c + 1];
-                    _22 = A[r + ch + 1][c + 2];
-                    _23 = A[r + ch + 1][c + 3];
-
-                    B[c + 0][r + ch] = _10;
-                    B[c + 1][r + ch] = _11;
-                    B[c + 2][r + ch] = _12;
-                    B[c + 3][r + ch] = _13;
-                    B[c + 0][r + ch + 1] = _20;
-                    B[c + 1][r + ch + 1] = _21;
-                    B[c + 2][r + ch + 1] = _22;
-                    B[c + 3][r + ch + 1] = _23;
+                    _10 = LD(A[r + ch][c + 0]);
+                    _11 = LD(A[r + ch][c + 1]);
+                    _12 = LD(A[r + ch][c + 2]);
+                    _13 = LD(A[r + ch][c + 3]);
+                    _20 = LD(A[r + ch + 1][c + 0]);
+                    _21 = LD(A[r + ch + 1][c + 1]);
+                    _22 = LD(A[r + ch + 1][c + 2]);
+                    _23 = LD(A[r + ch + 1][c + 3]);
+
+                    ST(B[c + 0][r + ch], _10);
+                    ST(B[c + 1][r + ch], _11);
+                    ST(B[c + 2][r + ch], _12);
+                    ST(B[c + 3][r + ch], _13);
+                    ST(B[c + 0][r + ch + 1], _20);
+                    ST(B[c + 1][r + ch + 1], _21);
+                    ST(B[c + 2][r + ch + 1], _22);
+                    ST(B[c + 3][r + ch + 1], _23);
                 }
 
                 c -= 4;
@@ -109,45 +124,45 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
                 int _0, _1, _2, _3, _4, _5, _6, _7;
                 int br; // block row
                 for (br = 0; br < 4; br++) {
-                    _0 = A[r + br][c + 0];
-                    _1 = A[r + br][c + 1];
-                    _2 = A[r + br][c + 2];
-                    _3 = A[r + br][c + 3];
-                    _4 = A[r + br][c + 4];
-                    _5 = A[r + br][c + 5];
-                    _6 = A[r + br][c + 6];
-                    _7 = A[r + br][c + 7];
-
-                    B[c + 0][r + br] = _0;
-                    B[c + 1][r + br] = _1;
-                    B[c + 2][r + br] = _2;
-                    B[c + 3][r + br] = _3;
-                    B[c + 0][r + br + 4] = _4;
-                    B[c + 1][r + br + 4] = _5;
-                    B[c + 2][r + br + 4] = _6;
-                    B[c + 3][r + br + 4] = _7;
+                    _0 = LD(A[r + br][c + 0]);
+                    _1 = LD(A[r + br][c + 1]);
+                    _2 = LD(A[r + br][c + 2]);
+                    _3 = LD(A[r + br][c + 3]);
+                    _4 = LD(A[r + br][c + 4]);
+                    _5 = LD(A[r + br][c + 5]);
+                    _6 = LD(A[r + br][c + 6]);
+                    _7 = LD(A[r + br][c + 7]);
+
+                    ST(B[c + 0][r + br], _0);
+                    ST(B[c + 1][r + br], _1);
+                    ST(B[c + 2][r + br], _2);
+                    ST(B[c + 3][r + br], _3);
+                    ST(B[c + 0][r + br + 4], _4);
+                    ST(B[c + 1][r + br + 4], _5);
+                    ST(B[c + 2][r + br + 4], _6);
+                    ST(B[c + 3][r + br + 4], _7);
                 }
 
                 for (br = 0; br < 4; br++) {
-                    _0 = B[c + br][r + 4 + 0];
-                    _1 = B[c + br][r + 4 + 1];
-                    _2 = B[c + br][r + 4 + 2];
-                    _3 = B[c + br][r + 4 + 3];
-
-                    B[c + br][r + 4 + 0] = A[r + 4 + 0][c + br];
-                    B[c + br][r + 4 + 1] = A[r + 4 + 1][c + br];
-                    B[c + br][r + 4 + 2] = A[r + 4 + 2][c + br];
-                    B[c + br][r + 4 + 3] = A[r + 4 + 3][c + br];
-
-                    B[c + 4 + br][r + 0] = _0;
-                    B[c + 4 + br][r + 1] = _1;
-                    B[c + 4 + br][r + 2] = _2;
-                    B[c + 4 + br][r + 3] = _3;
-
-                    B[c + 4 + br][r + 4] = A[r + 4 + 0][c + 4 + br];
-                    B[c + 4 + br][r + 5] = A[r + 4 + 1][c + 4 + br];
-                    B[c + 4 + br][r + 6] = A[r + 4 + 2][c + 4 + br];
-                    B[c + 4 + br][r + 7] = A[r + 4 + 3][c + 4 + br];
+                    _0 = LD(B[c + br][r + 4 + 0]);
+                    _1 = LD(B[c + br][r + 4 + 1]);
+                    _2 = LD(B[c + br][r + 4 + 2]);
+                    _3 = LD(B[c + br][r + 4 + 3]);
+
+                    ST(B[c + br][r + 4 + 0], LD(A[r + 4 + 0][c + br]));
+                    ST(B[c + br][r + 4 + 1], LD(A[r + 4 + 1][c + br]));
+                    ST(B[c + br][r + 4 + 2], LD(A[r + 4 + 2][c + br]));
+                    ST(B[c + br][r + 4 + 3], LD(A[r + 4 + 3][c + br]));
+
+                    ST(B[c + 4 + br][r + 0], _0);
+                    ST(B[c + 4 + br][r + 1], _1);
+                    ST(B[c + 4 + br][r + 2], _2);
+                    ST(B[c + 4 + br][r + 3], _3);
+
+                    ST(B[c + 4 + br][r + 4], LD(A[r + 4 + 0][c + 4 + br]));
+                    ST(B[c + 4 + br][r + 5], LD(A[r + 4 + 1][c + 4 + br]));
+                    ST(B[c + 4 + br][r + 6], LD(A[r + 4 + 2][c + 4 + br]));
+                    ST(B[c + 4 + br][r + 7], LD(A[r + 4 + 3][c + 4 + br]));
                 }
             }
         }*/
@@ -158,7 +173,7 @@ void transpose_submit(int M, int N, int A[N][M], int B[M][N])
             for (int c = 0; c < M; c += BS) { // matrix column
                 for (int bc = 0; bc < BS && (c + bc < 61); bc++) { // block column
                     for (int br = 0; (br < BS) && r + br < 67; br++) { // block row
-                        B[c + bc][r + br] = A[r + br][c + bc];
+                        ST(B[c + bc][r + br], LD(A[r + br][c + bc]));
                     }
                 }
             }
@@ -181,8 +196,8 @@ void trans(int M, int N, int A[N][M], int B[M][N])
 
     for (i = 0; i < N; i++) {
         for (j = 0; j < M; j++) {
-            tmp = A[i][j];
-            B[j][i] = tmp;
+            tmp = LD(A[i][j]);
+            ST(B[j][i], tmp);
         }
     }
 }
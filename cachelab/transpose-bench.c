@@ -0,0 +1,197 @@
+/*
+ * transpose-bench.c - Cached vs. streaming (non-temporal) stores in transpose()
+ *
+ * The same small source matrix is transposed into many destination copies
+ * (transpose_batch with a source step of 0). The source and a warm victim
+ * buffer both fit in the L2 cache, so only the destination can push the
+ * victim out, and that is what the streaming stores are supposed to avoid.
+ *
+ * For every mode it reports the effective bandwidth (bytes read + written
+ * per second) and how long it takes to re-read the victim right after the
+ * transpose, plus the last level cache misses of the transpose and of the
+ * re-read where the kernel exposes hardware counters (perf_event_open).
+ * Two more re-reads frame the numbers: "warm" right after warming up the victim,
+ * and "idle" after spinning for as long as the streaming transpose took, which
+ * is what interrupts and other tenants of the machine evict in that time.
+ *
+ * Build:
+ *     gcc -O2 -march=native -o transpose-bench transpose-bench.c transpose.c
+ *
+ * Usage: ./transpose-bench [-n rows/cols] [-e element size] [-c copies] [-v victim KB] [-r repeats]
+ */
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "transpose.h"
+
+static double now_sec()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// last level cache misses of this thread, -1 if there is no such counter (e.g. in a VM)
+static int open_llc_misses()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t count = 0;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    return count;
+}
+
+static uint64_t read_victim(const uint64_t* victim, size_t count)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i += 8) { // one read per cache line
+        sum += victim[i];
+    }
+    return sum;
+}
+
+static double run(const char* name, size_t threshold, size_t n, size_t es, size_t copies, int repeats,
+    void* src, void* dst, uint64_t* victim, size_t victim_count, int counter)
+{
+    double transpose_time = 0;
+    double victim_time = 0;
+    uint64_t transpose_misses = 0;
+    uint64_t victim_misses = 0;
+    uint64_t sink = 0;
+
+    transpose_stream_threshold = threshold;
+
+    for (int i = 0; i < repeats; i++) {
+        sink += read_victim(victim, victim_count); // warm up the victim
+        sink += read_victim(src, n * n * es / sizeof(uint64_t)); // and the source
+
+        uint64_t c0 = read_counter(counter);
+        double start = now_sec();
+        transpose_batch(src, n, 0, dst, n, n * n, n, n, es, copies);
+        double mid = now_sec();
+        uint64_t c1 = read_counter(counter);
+        sink += read_victim(victim, victim_count);
+        double end = now_sec();
+        uint64_t c2 = read_counter(counter);
+
+        transpose_time += mid - start;
+        victim_time += end - mid;
+        transpose_misses += c1 - c0;
+        victim_misses += c2 - c1;
+    }
+
+    double bytes = 2.0 * n * n * es * copies * repeats;
+
+    printf("%-10s %8.2f GB/s   victim re-read %8.1f us", name, bytes / transpose_time / 1e9,
+        victim_time / repeats * 1e6);
+    if (counter >= 0) {
+        printf("   LLC misses: transpose %10lu, re-read %8lu", (unsigned long)(transpose_misses / repeats),
+            (unsigned long)(victim_misses / repeats));
+    }
+    printf("   (%lu)\n", (unsigned long)(sink & 1));
+
+    return transpose_time / repeats;
+}
+
+static void run_idle(const char* name, double seconds, int repeats, uint64_t* victim, size_t victim_count)
+{
+    double victim_time = 0;
+    uint64_t sink = 0;
+
+    for (int i = 0; i < repeats; i++) {
+        sink += read_victim(victim, victim_count);
+
+        double start = now_sec();
+        while (now_sec() - start < seconds) {
+        }
+
+        double mid = now_sec();
+        sink += read_victim(victim, victim_count);
+        victim_time += now_sec() - mid;
+    }
+
+    printf("%-10s %8s        victim re-read %8.1f us   (%lu)\n", name, "", victim_time / repeats * 1e6,
+        (unsigned long)(sink & 1));
+}
+
+int main(int argc, char** argv)
+{
+    int c;
+    size_t n = 256;
+    size_t es = 4;
+    size_t copies = 64;
+    size_t victim_kb = 256;
+    int repeats = 10;
+
+    while ((c = getopt(argc, argv, "n:e:c:v:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'e':
+            es = atol(optarg);
+            break;
+        case 'c':
+            copies = atol(optarg);
+            break;
+        case 'v':
+            victim_kb = atol(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        }
+    }
+
+    void* src = aligned_alloc(64, n * n * es);
+    void* dst = aligned_alloc(64, n * n * es * copies);
+    size_t victim_count = victim_kb * 1024 / sizeof(uint64_t);
+    uint64_t* victim = aligned_alloc(64, victim_count * sizeof(uint64_t));
+
+    memset(src, 1, n * n * es);
+    memset(dst, 0, n * n * es * copies);
+    memset(victim, 2, victim_count * sizeof(uint64_t));
+
+    int counter = open_llc_misses();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    printf("%zu x %zu, %zu byte elements, %zu copies (%zu MB output), %zu KB victim%s\n", n, n, es, copies,
+        n * n * es * copies >> 20, victim_kb, (counter >= 0) ? "" : ", no LLC miss counter");
+
+    run_idle("warm", 0, repeats, victim, victim_count);
+    run("cached", SIZE_MAX, n, es, copies, repeats, src, dst, victim, victim_count, counter);
+    double seconds = run("streaming", 0, n, es, copies, repeats, src, dst, victim, victim_count, counter);
+    run_idle("idle", seconds, repeats, victim, victim_count);
+
+    if (counter >= 0) {
+        close(counter);
+    }
+    free(src);
+    free(dst);
+    free(victim);
+
+    return EXIT_SUCCESS;
+}
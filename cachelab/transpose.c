@@ -0,0 +1,222 @@
+/*
+ * transpose.c - Cache blocked transpose for any element size, padded row
+ *     strides and batches of matrices
+ *
+ * Same idea as transpose_submit in trans.c, the matrix is copied in square
+ * tiles. The tile edge is chosen per element size so that one tile row fills
+ * a whole 64 byte cache line: 8 x 8 doubles, 16 x 16 floats, 32 x 32 int16s
+ * and 64 x 64 bytes.
+ *
+ * Once the output is bigger than transpose_stream_threshold, writing B
+ * through the cache only hurts: every store first reads the line in
+ * (read-for-ownership) and the result evicts whatever runs next. In that
+ * streaming mode full tiles are transposed into an L1 resident scratch tile
+ * first and then written out a whole line at a time with non-temporal stores.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "transpose.h"
+
+#define CACHE_LINE 64
+
+size_t transpose_stream_threshold = 16 << 20;
+
+typedef void (*TileFn)(const void* src, size_t lds, void* dst, size_t ldd);
+typedef void (*EdgeFn)(const void* src, size_t lds, void* dst, size_t ldd, size_t rows, size_t cols);
+
+typedef struct Kernel {
+    size_t elem_size;
+    size_t tile;
+    TileFn tile_fn; // full tile, the bounds are constants so the loops get unrolled
+    EdgeFn edge_fn; // partial tile at the right / bottom edge
+} Kernel;
+
+// The elements are floats, doubles, int16s... whatever the caller has, so they are
+// copied as bytes rather than through a type* (strict aliasing). A memcpy of a
+// constant size still compiles to a single load and store.
+#define DEFINE_KERNEL(name, type)                                                          \
+    static void name##_tile(const void* src, size_t lds, void* dst, size_t ldd)           \
+    {                                                                                      \
+        const uint8_t* s = (const uint8_t*)src;                                            \
+        uint8_t* d = (uint8_t*)dst;                                                        \
+        for (size_t r = 0; r < CACHE_LINE / sizeof(type); r++) {                           \
+            for (size_t c = 0; c < CACHE_LINE / sizeof(type); c++) {                       \
+                memcpy(d + (c * ldd + r) * sizeof(type), s + (r * lds + c) * sizeof(type), \
+                    sizeof(type));                                                         \
+            }                                                                              \
+        }                                                                                  \
+    }                                                                                      \
+                                                                                           \
+    static void name##_edge(                                                               \
+        const void* src, size_t lds, void* dst, size_t ldd, size_t rows, size_t cols)     \
+    {                                                                                      \
+        const uint8_t* s = (const uint8_t*)src;                                            \
+        uint8_t* d = (uint8_t*)dst;                                                        \
+        for (size_t r = 0; r < rows; r++) {                                                \
+            for (size_t c = 0; c < cols; c++) {                                            \
+                memcpy(d + (c * ldd + r) * sizeof(type), s + (r * lds + c) * sizeof(type), \
+                    sizeof(type));                                                         \
+            }                                                                              \
+        }                                                                                  \
+    }
+
+DEFINE_KERNEL(u8, uint8_t)
+DEFINE_KERNEL(u16, uint16_t)
+DEFINE_KERNEL(u32, uint32_t)
+DEFINE_KERNEL(u64, uint64_t)
+
+static const Kernel kernels[] = {
+    { 1, CACHE_LINE / 1, u8_tile, u8_edge },
+    { 2, CACHE_LINE / 2, u16_tile, u16_edge },
+    { 4, CACHE_LINE / 4, u32_tile, u32_edge },
+    { 8, CACHE_LINE / 8, u64_tile, u64_edge },
+};
+
+static const Kernel*
+find_kernel(size_t elem_size)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].elem_size == elem_size) {
+            return &kernels[i];
+        }
+    }
+    return NULL;
+}
+
+// Fallback for odd element sizes (e.g. 3 byte RGB pixels), an element at a time
+static void transpose_bytes(
+    const void* src, size_t lds, void* dst, size_t ldd, size_t rows, size_t cols, size_t elem_size)
+{
+    const uint8_t* s = (const uint8_t*)src;
+    uint8_t* d = (uint8_t*)dst;
+    // as many elements as fit in a line, one per tile row for elements bigger than a line
+    size_t tile = (elem_size < CACHE_LINE) ? CACHE_LINE / elem_size : 1;
+
+    for (size_t r = 0; r < rows; r += tile) {
+        for (size_t c = 0; c < cols; c += tile) {
+            for (size_t br = r; br < r + tile && br < rows; br++) {
+                for (size_t bc = c; bc < c + tile && bc < cols; bc++) {
+                    memcpy(d + (bc * ldd + br) * elem_size, s + (br * lds + bc) * elem_size, elem_size);
+                }
+            }
+        }
+    }
+}
+
+// Writes one 64 byte line from the scratch tile, bypassing the cache if possible
+static inline void stream_line(uint8_t* dst, const uint8_t* line)
+{
+#if defined(__SSE2__)
+    for (int i = 0; i < CACHE_LINE; i += 16) {
+        _mm_stream_si128((__m128i*)(dst + i), _mm_load_si128((const __m128i*)(line + i)));
+    }
+#else
+    memcpy(dst, line, CACHE_LINE);
+#endif
+}
+
+static void transpose_tile_stream(
+    const Kernel* k, const uint8_t* s_tile, size_t lds, uint8_t* d_tile, size_t ldd)
+{
+    _Alignas(CACHE_LINE) uint8_t scratch[CACHE_LINE * CACHE_LINE];
+
+    // row stride of the scratch tile is exactly one line
+    k->tile_fn(s_tile, lds, scratch, k->tile);
+
+    for (size_t i = 0; i < k->tile; i++) {
+        stream_line(d_tile + i * ldd * k->elem_size, scratch + i * CACHE_LINE);
+    }
+}
+
+static void transpose_tiled(
+    const Kernel* k, const void* src, size_t lds, void* dst, size_t ldd, size_t rows, size_t cols,
+    int stream)
+{
+    const uint8_t* s = (const uint8_t*)src;
+    uint8_t* d = (uint8_t*)dst;
+    size_t es = k->elem_size;
+    size_t tile = k->tile;
+
+    // Small matrices (e.g. image tiles in a batch) are a single edge call
+    if (rows <= tile && cols <= tile) {
+        k->edge_fn(s, lds, d, ldd, rows, cols);
+        return;
+    }
+
+    for (size_t r = 0; r < rows; r += tile) { // matrix row
+        size_t tile_rows = (rows - r < tile) ? rows - r : tile;
+
+        for (size_t c = 0; c < cols; c += tile) { // matrix column
+            size_t tile_cols = (cols - c < tile) ? cols - c : tile;
+            const uint8_t* s_tile = s + (r * lds + c) * es;
+            uint8_t* d_tile = d + (c * ldd + r) * es;
+
+            if (tile_rows == tile && tile_cols == tile && stream) {
+                transpose_tile_stream(k, s_tile, lds, d_tile, ldd);
+            } else if (tile_rows == tile && tile_cols == tile) {
+                k->tile_fn(s_tile, lds, d_tile, ldd);
+            } else {
+                k->edge_fn(s_tile, lds, d_tile, ldd, tile_rows, tile_cols);
+            }
+        }
+    }
+}
+
+void transpose(
+    const void* src,
+    size_t lds,
+    void* dst,
+    size_t ldd,
+    size_t rows,
+    size_t cols,
+    size_t elem_size)
+{
+    transpose_batch(src, lds, 0, dst, ldd, 0, rows, cols, elem_size, 1);
+}
+
+void transpose_batch(
+    const void* src,
+    size_t lds,
+    size_t src_step,
+    void* dst,
+    size_t ldd,
+    size_t dst_step,
+    size_t rows,
+    size_t cols,
+    size_t elem_size,
+    size_t count)
+{
+    const uint8_t* s = (const uint8_t*)src;
+    uint8_t* d = (uint8_t*)dst;
+    const Kernel* k = find_kernel(elem_size);
+
+    // Every line of a tile has to be a whole cache line of B. A line that straddles
+    // two is written as two partial lines, which is slower than the cached stores.
+    int stream = k != NULL
+        && count * rows * cols * elem_size > transpose_stream_threshold
+        && (uintptr_t)d % CACHE_LINE == 0
+        && (ldd * elem_size) % CACHE_LINE == 0
+        && (dst_step * elem_size) % CACHE_LINE == 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* s_mat = s + i * src_step * elem_size;
+        uint8_t* d_mat = d + i * dst_step * elem_size;
+
+        if (k != NULL) {
+            transpose_tiled(k, s_mat, lds, d_mat, ldd, rows, cols, stream);
+        } else {
+            transpose_bytes(s_mat, lds, d_mat, ldd, rows, cols, elem_size);
+        }
+    }
+
+#if defined(__SSE2__)
+    if (stream) {
+        _mm_sfence(); // make the streamed lines visible before returning
+    }
+#endif
+}
@@ -0,0 +1,45 @@
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+#include <stddef.h>
+
+/*
+ * Outputs (whole batch) larger than this many bytes are written with
+ * non-temporal stores, see transpose.c. 0 always streams, SIZE_MAX never does.
+ */
+extern size_t transpose_stream_threshold;
+
+/*
+ * Out-of-place transpose of a rows x cols matrix of elem_size byte elements.
+ *
+ * src is stored with a row stride (leading dimension) of lds elements and
+ * dst (cols x rows) with a row stride of ldd elements, so padded planes
+ * work as well: lds >= cols, ldd >= rows.
+ */
+void transpose(
+    const void* src,
+    size_t lds,
+    void* dst,
+    size_t ldd,
+    size_t rows,
+    size_t cols,
+    size_t elem_size);
+
+/*
+ * Transposes count matrices of the same shape. Matrix i starts
+ * i * src_step elements after src and i * dst_step elements after dst
+ * (e.g. the channels of an image). The kernel is picked only once.
+ */
+void transpose_batch(
+    const void* src,
+    size_t lds,
+    size_t src_step,
+    void* dst,
+    size_t ldd,
+    size_t dst_step,
+    size_t rows,
+    size_t cols,
+    size_t elem_size,
+    size_t count);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * mm-bench.c - Trace replay benchmark for mm.c
+ *
+ * Replays allocation traces against mm_init / mm_malloc / mm_free / mm_realloc
+ * and reports the throughput, the latency percentiles of single operations,
+ * the peak heap size and the utilisation (peak live payload / peak heap).
+ * With -g the same trace is replayed against the C library malloc as well.
+ *
+ * A trace is either in the mdriver format (a header of 4 numbers: suggested
+ * heap size, number of ids, number of operations, weight) or just the
+ * operations, one per line, with '#' comments:
+ *     a <id> <size>    malloc
+ *     r <id> <size>    realloc
+ *     f <id>           free
+ *
+ * The throughput is measured over whole replays without a clock read per
+ * operation, the latencies come from one extra replay that times every operation.
+ *
+ * Build:
+ *     gcc -O2 -DNDEBUG -o mm-bench mm-bench.c mm.c memlib.c
+ *
+ * Usage: ./mm-bench [-r repeats] [-g] trace...
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+typedef struct {
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct {
+    op_t *ops;
+    size_t num_ops;
+    int num_ids;
+} trace_t;
+
+typedef struct {
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} allocator_t;
+
+static int libc_init(void) {
+    return 0;
+}
+
+static const allocator_t mm_allocator = {mm_init, mm_malloc, mm_free, mm_realloc};
+static const allocator_t libc_allocator = {libc_init, malloc, free, realloc};
+
+static void **blocks;
+
+static double now_sec() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+read_trace(const char *path, trace_t *trace) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = 1024;
+    trace->ops = malloc(capacity * sizeof(op_t));
+    trace->num_ops = 0;
+    trace->num_ids = 0;
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+        // the mdriver header, the numbers of ids and operations are counted anyway
+        if (trace->num_ops == 0 && *p >= '0' && *p <= '9') {
+            continue;
+        }
+
+        op_t op = {0};
+        int fields = sscanf(p, "%c %d %zu", &op.type, &op.id, &op.size);
+        if (op.id < 0 || !((op.type == 'a' && fields == 3) || (op.type == 'r' && fields == 3)
+                           || (op.type == 'f' && fields >= 2))) {
+            fprintf(stderr, "%s:%d: bad operation: %s", path, lineno, line);
+            fclose(f);
+            return -1;
+        }
+
+        if (trace->num_ops == capacity) {
+            capacity *= 2;
+            trace->ops = realloc(trace->ops, capacity * sizeof(op_t));
+        }
+        trace->ops[trace->num_ops++] = op;
+
+        if (op.id >= trace->num_ids) {
+            trace->num_ids = op.id + 1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// one operation, returns 0 if an allocation failed
+static inline int
+replay_op(const allocator_t *a, const op_t *op) {
+    switch (op->type) {
+    case 'a':
+        blocks[op->id] = a->malloc(op->size);
+        return blocks[op->id] != NULL || op->size == 0;
+    case 'r':
+        blocks[op->id] = a->realloc(blocks[op->id], op->size);
+        return blocks[op->id] != NULL || op->size == 0;
+    default:
+        a->free(blocks[op->id]);
+        blocks[op->id] = NULL;
+        return 1;
+    }
+}
+
+static int
+start_replay(const allocator_t *a, const trace_t *trace) {
+    memset(blocks, 0, trace->num_ids * sizeof(void *));
+    if (a == &mm_allocator) {
+        mem_reset_brk();
+    }
+    return a->init();
+}
+
+// frees what the trace left allocated, so the C library heap starts empty on the next replay
+static void
+end_replay(const allocator_t *a, const trace_t *trace) {
+    for (int i = 0; i < trace->num_ids; i++) {
+        a->free(blocks[i]);
+    }
+}
+
+static int
+cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t *sorted, size_t count, double p) {
+    size_t i = (size_t)(p * (count - 1));
+    return sorted[i];
+}
+
+static int
+bench(const char *name, const allocator_t *a, const trace_t *trace, int repeats, uint64_t *latencies) {
+    // throughput
+    double elapsed = 0;
+    for (int r = 0; r < repeats; r++) {
+        if (start_replay(a, trace) < 0) {
+            fprintf(stderr, "%s: init failed\n", name);
+            return -1;
+        }
+
+        double start = now_sec();
+        for (size_t i = 0; i < trace->num_ops; i++) {
+            if (!replay_op(a, &trace->ops[i])) {
+                fprintf(stderr, "%s: allocation %zu failed\n", name, i);
+                return -1;
+            }
+        }
+        elapsed += now_sec() - start;
+
+        end_replay(a, trace);
+    }
+
+    // latencies
+    start_replay(a, trace);
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        replay_op(a, &trace->ops[i]);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        latencies[i] = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+    }
+
+    qsort(latencies, trace->num_ops, sizeof(uint64_t), cmp_u64);
+
+    printf("  %-8s %8.2f   %6lu   %6lu   %7lu", name, trace->num_ops * repeats / elapsed / 1e6,
+        (unsigned long)percentile(latencies, trace->num_ops, 0.5),
+        (unsigned long)percentile(latencies, trace->num_ops, 0.99),
+        (unsigned long)percentile(latencies, trace->num_ops, 0.999));
+
+    return 0;
+}
+
+static size_t
+peak_payload(const trace_t *trace) {
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    size_t live = 0;
+    size_t peak = 0;
+
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        const op_t *op = &trace->ops[i];
+        live -= sizes[op->id];
+        sizes[op->id] = (op->type == 'f') ? 0 : op->size;
+        live += sizes[op->id];
+        if (live > peak) {
+            peak = live;
+        }
+    }
+
+    free(sizes);
+    return peak;
+}
+
+int
+main(int argc, char **argv) {
+    int c;
+    int repeats = 10;
+    int compare_libc = 0;
+
+    while ((c = getopt(argc, argv, "r:g")) != -1) {
+        switch (c) {
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'g':
+            compare_libc = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r repeats] [-g] trace...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc || repeats < 1) {
+        fprintf(stderr, "usage: %s [-r repeats] [-g] trace...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    mem_init();
+
+    printf("            Mops/s   p50 ns   p99 ns   p999 ns   peak heap    util\n");
+
+    int status = EXIT_SUCCESS;
+    for (int t = optind; t < argc; t++) {
+        trace_t trace;
+        if (read_trace(argv[t], &trace) < 0 || trace.num_ops == 0) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        blocks = malloc(trace.num_ids * sizeof(void *));
+        uint64_t *latencies = malloc(trace.num_ops * sizeof(uint64_t));
+
+        printf("%s (%zu ops)\n", argv[t], trace.num_ops);
+
+        // the heap only grows, after the last replay it's the peak of that replay
+        if (bench("mm", &mm_allocator, &trace, repeats, latencies) == 0) {
+            size_t heap = mem_heapsize();
+            printf("   %9zu   %4.1f%%\n", heap, 100.0 * peak_payload(&trace) / heap);
+        } else {
+            status = EXIT_FAILURE;
+        }
+
+        if (compare_libc) {
+            if (bench("libc", &libc_allocator, &trace, repeats, latencies) == 0) {
+                printf("           -       -\n");
+            }
+            end_replay(&libc_allocator, &trace);
+        }
+
+        free(latencies);
+        free(blocks);
+        free(trace.ops);
+    }
+
+    return status;
+}
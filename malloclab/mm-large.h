@@ -0,0 +1,13 @@
+#ifndef MM_LARGE_H
+#define MM_LARGE_H
+
+#include <stddef.h>
+
+/*
+    Requests of at least this many bytes are served from whole pages, see the
+    large path in mm.c. Anything below 1KB counts as 1KB, SIZE_MAX turns the
+    large path off. Only change it between mm_init and the first malloc.
+*/
+extern size_t mm_large_threshold;
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef MM_STATS_H
+#define MM_STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+    Allocator statistics, only collected in a build with -DMM_STATS.
+    Without it mm.c doesn't count anything and doesn't define these functions.
+*/
+
+// histogram buckets: 0, 1, 2-3, 4-7, 8-15, ... (the last one is open ended)
+#define MM_STATS_BUCKETS 8
+// free blocks by size: bucket i holds sizes 2^i .. 2^(i+1) - 1
+#define MM_STATS_SIZE_BUCKETS 32
+
+typedef struct mm_stats_t {
+    // calls
+    size_t malloc_calls;
+    size_t free_calls;
+    size_t realloc_calls;
+
+    // which path served a malloc that reached the heap
+    // (in thread-safe mode the thread caches are refilled through these as well)
+    size_t slab_mallocs;
+    size_t large_mallocs;
+    size_t arena_mallocs;
+
+    // how many free blocks find_fit_place looked at, and how often it
+    // had to take a block from a bigger class or found nothing at all
+    size_t fit_search_length[MM_STATS_BUCKETS];
+    size_t fit_bigger_class;
+    size_t fit_failed;
+    size_t fast_bin_consolidations;
+
+    size_t extend_heap_calls;
+    size_t extend_heap_bytes;
+
+    // realloc
+    size_t realloc_in_place; // the block stayed where it was
+    size_t realloc_moved;    // grown into the free block on the left (memmove)
+    size_t realloc_copied;   // malloc + memcpy + free
+
+    // the state of the heap when mm_stats was called
+    size_t heap_size;
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free_block;
+    size_t free_blocks_by_size[MM_STATS_SIZE_BUCKETS];
+    size_t slab_runs;
+    size_t slab_slots_used;  // including freed slots that are still cached
+    size_t large_free_bytes; // freed large pages, not on the free lists
+    size_t fast_bin_bytes;   // freed blocks waiting in the fast bins, not in free_bytes
+} mm_stats_t;
+
+// copies the counters and measures the heap
+void mm_stats(mm_stats_t *stats);
+
+// mm_stats as one JSON object
+void mm_stats_json(FILE *out);
+
+#endif
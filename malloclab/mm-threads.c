@@ -0,0 +1,113 @@
+/*
+ * mm-threads.c - Multithreaded malloc / free benchmark for the thread-safe mode of mm.c
+ *
+ * Every thread keeps a small working set of blocks and replaces a random one
+ * with a new block of random size on every iteration. The same amount of work
+ * per thread is run with 1, 2, 4, ... threads, with perfect scaling the
+ * throughput per thread stays the same.
+ *
+ * Build:
+ *     gcc -O2 -DNDEBUG -DMM_THREAD_SAFE -o mm-threads mm-threads.c mm.c memlib.c -lpthread
+ *
+ * Usage: ./mm-threads [-t max threads] [-n pairs per thread] [-s max size]
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define WORKING_SET 64
+
+static long pairs = 1000000;
+static int max_size = 512;
+
+static double now_sec() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *
+worker(void *arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    void *blocks[WORKING_SET] = {NULL};
+
+    for (long i = 0; i < pairs; i++) {
+        int slot = rand_r(&seed) % WORKING_SET;
+        size_t size = 1 + rand_r(&seed) % max_size;
+
+        mm_free(blocks[slot]);
+        blocks[slot] = mm_malloc(size);
+        if (blocks[slot] == NULL) {
+            fprintf(stderr, "mm_malloc failed\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(blocks[slot], 0, size < 16 ? size : 16);
+    }
+
+    for (int i = 0; i < WORKING_SET; i++) {
+        mm_free(blocks[i]);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv) {
+    int c;
+    int max_threads = 8;
+
+    while ((c = getopt(argc, argv, "t:n:s:")) != -1) {
+        switch (c) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            pairs = atol(optarg);
+            break;
+        case 's':
+            max_size = atoi(optarg);
+            break;
+        }
+    }
+
+    mem_init();
+
+    printf("threads   Mpairs/s   per thread   speedup\n");
+
+    double base = 0;
+    pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+
+    for (int n = 1; n <= max_threads; n *= 2) {
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            return EXIT_FAILURE;
+        }
+
+        double start = now_sec();
+        for (int t = 0; t < n; t++) {
+            pthread_create(&threads[t], NULL, worker, (void *)(size_t)(t + 1));
+        }
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double elapsed = now_sec() - start;
+
+        double rate = n * pairs / elapsed / 1e6;
+        if (n == 1) {
+            base = rate;
+        }
+
+        printf("%7d   %8.2f   %10.2f   %7.2f\n", n, rate, rate / n, rate / base);
+    }
+
+    free(threads);
+
+    return EXIT_SUCCESS;
+}
@@ -1,11 +1,21 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "memlib.h"
+#include "mm-large.h"
 #include "mm.h"
 
+#ifdef MM_STATS
+#include "mm-stats.h"
+#endif
+
 team_t team = {
     /* Team name */
     "Tom",
@@ -25,20 +35,87 @@ typedef unsigned char u8;
 // Constants
 #define WSIZE 4             /* Word and header/footer size (bytes) */
 #define DSIZE 8             /* Double word size (bytes) */
-#define CHUNKSIZE (1 << 10) /* Extend heap by this amount (bytes) */
-
-static const u32 MIN_FREE_SIZE = 6 * WSIZE; // headers, footer, next, and 4 bytes space
+#define ALIGNMENT 16        /* Payload alignment (bytes) */
+#define CHUNKSIZE (1 << 10) /* Initial heap and smallest extension (bytes) */
+
+static const u32 MIN_FREE_SIZE = 4 * WSIZE; // header, prev, next and footer
+
+// Block sizes and free list links are 32-bit, so one heap can't be bigger than this
+static const size_t MAX_HEAP_SIZE = UINT32_MAX - CHUNKSIZE;
+// and mem_sbrk takes an int
+static const size_t MAX_REQUEST_SIZE = INT32_MAX - 2 * ALIGNMENT;
+
+// Two-level segregated free lists (TLSF)
+// First level splits sizes by powers of two, the second level splits each of those
+// linearly into SL_COUNT classes. Sizes below SMALL_SIZE all go into first level 0,
+// where each class is exactly one ALIGNMENT granule wide.
+#define ALIGN_SHIFT 4
+#define SL_BITS 4
+#define SL_COUNT (1 << SL_BITS)
+#define FL_SHIFT (SL_BITS + ALIGN_SHIFT)
+#define SMALL_SIZE (1 << FL_SHIFT)
+#define FL_COUNT (32 - FL_SHIFT + 1)
+#define NUM_CLASSES (FL_COUNT * SL_COUNT)
+
+// How many blocks of the request's own class are checked for a better fit
+// before falling back to the first block of a bigger class
+#define FIT_SCAN_LIMIT 8
+
+// Freed arena blocks up to this size go into a fast bin first, see fast_bin_push
+#define FAST_BIN_MAX_SIZE 512
+#define FAST_BINS (FAST_BIN_MAX_SIZE / ALIGNMENT + 1) // indexed by block size / ALIGNMENT
+
+// Heap growth, see grow_heap
+#define GROWTH_WINDOW 256    // extensions fewer allocations apart than this grow faster
+#define MAX_GROWTH (1 << 20) // most space (bytes) added on top of what is needed
+#define GROWTH_CAP_SHIFT 6   // and at most heap size / 64 of it
 
 // global variables
 static u8 *heap_start = 0;
 static u8 *heap_end = 0;
-static u8 *free_blocks = 0; // pointer to a header
+static u8 *free_blocks[NUM_CLASSES]; // pointers to the first block of each class
+static u32 fl_bitmap = 0;            // bit fl set = some class in first level fl is non-empty
+static u32 sl_bitmap[FL_COUNT];      // bit sl set = class (fl, sl) is non-empty
+
+static u32 fast_bins[FAST_BINS]; // heap offsets of the first block of each fast bin
+static u32 fast_bin_count = 0;   // blocks in all fast bins
+
+static u32 heap_growth = CHUNKSIZE;  // extra space the next extension adds
+static u32 allocs_since_growth = 0; // arena allocations since the last extension
 
 // helper functions for calculations
 #define PACK(size, alloc) ((size) | (alloc)) // Pack a size and allocated bit into a word
 
+// header bits
+#define ALLOC 0x1
+#define PREV_FREE 0x2 // the previous block is free, so there is a footer before the header
+#define REALLOCED 0x4 // the block was grown by realloc, see with_slack
+#define LARGE 0x8     // a block of the large path, see large_malloc
+
 // forward declarations
 static inline void coalesce(u8 *bp);
+static void *heap_malloc(size_t size);
+static u32 release_large_free_pages(u32 size);
+
+// Statistics (-DMM_STATS, see mm-stats.h), STAT() compiles to nothing without it
+#ifdef MM_STATS
+static mm_stats_t stats;
+
+#ifdef MM_THREAD_SAFE
+#define STAT(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define STAT(field, n) (stats.field += (n))
+#endif
+
+// 0, 1, 2-3, 4-7, ...
+static inline u32
+stat_bucket(size_t n) {
+    u32 bucket = (n == 0) ? 0 : 64 - __builtin_clzll(n);
+    return (bucket < MM_STATS_BUCKETS) ? bucket : MM_STATS_BUCKETS - 1;
+}
+#else
+#define STAT(field, n) ((void)0)
+#endif
 
 // write a 32-bit value into memory
 static inline void
@@ -46,113 +123,212 @@ put(void *addr, u32 val) {
     (*(u32 *)addr) = val;
 }
 
-// get_size() - size is without the footer
+// for the header of a block that may be in use - in thread-safe mode its owner
+// reads the size without holding the lock, only the PREV_FREE bit changes under it
+static inline void
+put_atomic(void *addr, u32 val) {
+    __atomic_store_n((u32 *)addr, val, __ATOMIC_RELAXED);
+}
+
+// get_size() - size includes the header (and the footer of free blocks)
 static inline u32
 get_size(u32 *header_addr) {
-    return (*header_addr) & ~0x3;
+    return (*header_addr) & ~(ALIGNMENT - 1);
 }
 
 static inline u32
 is_alloc(u32 *header_addr) {
-    return (*header_addr) & 0x1;
+    return (*header_addr) & ALLOC;
+}
+
+static inline u32
+prev_free_bit(u32 *header_addr) {
+    return (*header_addr) & PREV_FREE;
 }
 
 // return the header address of a block
 static inline u32 *
 header_field(u8 *bp) {
-    return (u32 *)(bp - 3 * WSIZE);
+    return (u32 *)(bp - WSIZE);
 }
 
-// return pointer to the next block
+// free blocks keep the list links in the first 8 bytes of the payload
 static inline u32 *
-next_free_field(u8 *bp) {
-    return (u32 *)(bp - WSIZE);
+prev_free_field(u8 *bp) {
+    return (u32 *)bp;
 }
 
 static inline u32 *
-prev_free_field(u8 *bp) {
-    return (u32 *)(bp - 2 * WSIZE);
+next_free_field(u8 *bp) {
+    return (u32 *)(bp + WSIZE);
+}
+
+// The links are stored as 32-bit offsets from heap_start, so that free blocks
+// stay 16 bytes in a 64-bit build. Offset 0 is never a block, it means NULL.
+static inline u32
+to_offset(u8 *bp) {
+    return (bp == NULL) ? 0 : (u32)(bp - heap_start);
+}
+
+static inline u8 *
+from_offset(u32 offset) {
+    return (offset == 0) ? NULL : heap_start + offset;
 }
 
 // return pointer to the next block
 static inline u8 *
 next_free(u8 *bp) {
-    return (u8 *)*next_free_field(bp);
+    return from_offset(*next_free_field(bp));
 }
 
-// return pointer to the next block
+// return pointer to the previous block
 static inline u8 *
 prev_free(u8 *bp) {
-    return (u8 *)*prev_free_field(bp);
+    return from_offset(*prev_free_field(bp));
 }
 
-// return the footer address of a block
+// return the footer address of a block, only free blocks have one
 static inline u32 *
 footer_field(u8 *bp) {
-    u32 *_header_addr = header_field(bp);
-    return (u32 *)((u8 *)_header_addr + get_size(_header_addr) - WSIZE);
+    return (u32 *)(bp + get_size(header_field(bp)) - DSIZE);
 }
 
+// only valid if the previous block is free
 static inline u32 *
 prev_footer(u8 *bp) {
-    return (u32 *)(bp - 4 * WSIZE);
-}
-
-static inline u32 *
-next_header(u8 *bp) {
-    return (u32 *)(((u8 *)footer_field(bp)) + WSIZE);
+    return (u32 *)(bp - DSIZE);
 }
 
 static inline u8 *
 next_block_addr(u8 *bp) {
-    return ((u8 *)footer_field(bp)) + 4 * WSIZE;
+    return bp + get_size(header_field(bp));
+}
+
+static inline u32 *
+next_header(u8 *bp) {
+    return header_field(next_block_addr(bp));
 }
 
+// only valid if the previous block is free
 static inline u8 *
 prev_block_addr(u8 *bp) {
-    u8 *_prev_footer = (u8 *)prev_footer(bp);
-    return _prev_footer - get_size((u32 *)_prev_footer) + 4 * WSIZE;
+    return bp - get_size(prev_footer(bp));
 }
 
 static inline u32 *
 prev_header(u8 *bp) {
-    return (u32 *)(prev_block_addr(bp) - 3 * WSIZE);
+    return header_field(prev_block_addr(bp));
+}
+
+// write the header (and the footer if free), keeps the PREV_FREE bit of the block
+// and updates the one of the following block
+static inline void
+set_block(u8 *bp, u32 size, u32 alloc) {
+    put(header_field(bp), PACK(size, alloc) | prev_free_bit(header_field(bp)));
+
+    u32 *_next_header = header_field(bp + size);
+    if (alloc) {
+        put_atomic(_next_header, *_next_header & ~PREV_FREE);
+    } else {
+        put(footer_field(bp), size);
+        put_atomic(_next_header, *_next_header | PREV_FREE);
+    }
+}
+
+// class that contains blocks of this size
+static inline u32
+size_class(u32 size) {
+    if (size < SMALL_SIZE) {
+        return size >> ALIGN_SHIFT;
+    }
+
+    u32 log2 = 31 - __builtin_clz(size);
+    u32 fl = log2 - FL_SHIFT + 1;
+    u32 sl = (size >> (log2 - SL_BITS)) & (SL_COUNT - 1);
+
+    return fl * SL_COUNT + sl;
+}
+
+// first class whose blocks are all at least this big
+static inline u32
+size_class_round_up(u32 size) {
+    if (size >= SMALL_SIZE) {
+        u32 log2 = 31 - __builtin_clz(size);
+        size += (1 << (log2 - SL_BITS)) - 1;
+    }
+
+    return size_class(size);
+}
+
+// first non-empty class >= class, two find-first-set instead of a scan
+static inline u32
+find_non_empty_class(u32 class) {
+    u32 fl = class / SL_COUNT;
+    u32 sl = class % SL_COUNT;
+
+    u32 sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        u32 fl_map = (fl + 1 < 32) ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NUM_CLASSES;
+        }
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    return fl * SL_COUNT + __builtin_ctz(sl_map);
 }
 
 // linked list manipulation fucntions
+// the block has to be removed before its size changes, the class depends on it
 void
 remove_free_block(u8 *bp) {
     u8 *next_free_b = next_free(bp);
     u8 *prev_free_b = prev_free(bp);
+    u32 class = size_class(get_size(header_field(bp)));
 
     if (prev_free_b != NULL && next_free_b != NULL) {
         // middle - connect prev to next and vice versa
-        put(next_free_field(prev_free_b), (u32)next_free_b);
-        put(prev_free_field(next_free_b), (u32)prev_free_b);
+        put(next_free_field(prev_free_b), to_offset(next_free_b));
+        put(prev_free_field(next_free_b), to_offset(prev_free_b));
     } else if (prev_free_b == NULL && next_free_b != NULL) {
         // start
-        free_blocks = next_free_b;
-        put(prev_free_field(next_free_b), (u32)NULL);
+        free_blocks[class] = next_free_b;
+        put(prev_free_field(next_free_b), to_offset(NULL));
     } else if (prev_free_b != NULL && next_free_b == NULL) {
         // end
-        put(next_free_field(prev_free_b), (u32)NULL);
+        put(next_free_field(prev_free_b), to_offset(NULL));
     } else {
-        free_blocks = NULL;
+        // last block of the class
+        u32 fl = class / SL_COUNT;
+
+        free_blocks[class] = NULL;
+        sl_bitmap[fl] &= ~(1u << (class % SL_COUNT));
+        if (sl_bitmap[fl] == 0) {
+            fl_bitmap &= ~(1u << fl);
+        }
     }
 }
 
 void
 add_free_block(u8 *bp) {
-    if (free_blocks == NULL) {
+    u32 class = size_class(get_size(header_field(bp)));
+    u8 **free_list = &free_blocks[class];
+
+    if (*free_list == NULL) {
         // only block
-        free_blocks = bp;
-        put(prev_free_field(bp), (u32)NULL);
-        put(next_free_field(bp), (u32)NULL);
+        *free_list = bp;
+        put(prev_free_field(bp), to_offset(NULL));
+        put(next_free_field(bp), to_offset(NULL));
+
+        sl_bitmap[class / SL_COUNT] |= 1u << (class % SL_COUNT);
+        fl_bitmap |= 1u << (class / SL_COUNT);
     } else {
-        put(prev_free_field(bp), (u32)NULL);
-        put(prev_free_field(free_blocks), (u32)bp);
-        put(next_free_field(bp), (u32)free_blocks);
-        free_blocks = bp;
+        put(prev_free_field(bp), to_offset(NULL));
+        put(prev_free_field(*free_list), to_offset(bp));
+        put(next_free_field(bp), to_offset(*free_list));
+        *free_list = bp;
     }
 }
 
@@ -168,25 +344,29 @@ check_heap_dump() {
     u32 free_count_list = 0;
     u32 free_count_all = 0;
 
-    {
-        u8 *bp = free_blocks;
+    for (u32 class = 0; class < NUM_CLASSES; class++) {
+        u8 *bp = free_blocks[class];
         while (bp != NULL) {
             u8 *prev_block = prev_free(bp);
             u8 *next_block = next_free(bp);
 
             if (LOG >= 2) {
-                printf("   ├0x%x size = %d\n", (u32)bp, get_size(header_field(bp)));
+                printf("   ├%p size = %u\n", bp, get_size(header_field(bp)));
             }
 
             // Checks
-            assert((u32)bp % 8 == 0);
+            assert((uintptr_t)bp % ALIGNMENT == 0);
+            assert(size_class(get_size(header_field(bp))) == class);
+            assert(!is_alloc(header_field(bp)));
+            assert(sl_bitmap[class / SL_COUNT] & (1u << (class % SL_COUNT)));
+            assert(fl_bitmap & (1u << (class / SL_COUNT)));
 
             if (prev_block != NULL) {
                 assert(next_free(prev_block) == bp);
             }
 
             if (next_block != NULL) {
-                assert(next_free(bp) == next_block);
+                assert(prev_free(next_block) == bp);
             }
 
             free_count_list += 1;
@@ -195,12 +375,24 @@ check_heap_dump() {
         }
     }
 
+    u32 fast_count = 0;
+    for (u32 bin = 0; bin < FAST_BINS; bin++) {
+        for (u8 *bp = from_offset(fast_bins[bin]); bp != NULL; bp = from_offset(*(u32 *)bp)) {
+            // a block in a fast bin is still allocated as far as the heap is concerned
+            assert(is_alloc(header_field(bp)));
+            assert(get_size(header_field(bp)) == bin * ALIGNMENT);
+            fast_count++;
+        }
+    }
+    assert(fast_count == fast_bin_count);
+
     if (LOG >= 2) {
         printf("\n   BLOCKS\n");
     }
 
     {
-        u8 *bp = heap_start + 4 * WSIZE;
+        u8 *bp = heap_start + ALIGNMENT;
+        u32 prev_free = 0;
         while (bp < heap_end) {
             if (LOG >= 2) {
                 char *alloc_symbol = "|■|";
@@ -209,26 +401,29 @@ check_heap_dump() {
                 }
 
                 printf(
-                    "   ├0x%x %s size = %d\n", (u32)bp, alloc_symbol,
+                    "   ├%p %s size = %u\n", bp, alloc_symbol,
                     get_size(header_field(bp)));
             }
 
-            assert(*header_field(bp) == *footer_field(bp));
-
-            if (prev_block_addr(bp) > heap_start) {
-                assert(bp == next_block_addr(prev_block_addr(bp)));
-            }
+            assert(get_size(header_field(bp)) >= MIN_FREE_SIZE);
+            assert((uintptr_t)bp % ALIGNMENT == 0);
+            assert(!prev_free_bit(header_field(bp)) == !prev_free);
 
-            if (next_block_addr(bp) < heap_end) {
+            if (!is_alloc(header_field(bp))) {
+                assert(get_size(header_field(bp)) == *footer_field(bp));
                 assert(bp == prev_block_addr(next_block_addr(bp)));
-            }
+                assert(!prev_free); // no two free blocks next to each other
 
-            if (!is_alloc(header_field(bp))) {
                 free_count_all += 1;
             }
 
+            prev_free = !is_alloc(header_field(bp));
             bp = next_block_addr(bp);
         }
+
+        // epilogue
+        assert(bp == heap_end);
+        assert(*header_field(bp) == (PACK(0, ALLOC) | (prev_free ? PREV_FREE : 0)));
     }
 
     assert(free_count_list == free_count_all);
@@ -236,68 +431,90 @@ check_heap_dump() {
 #endif
 }
 
-int
-mm_init(void) {
+/*
+    Heap layout:
+    | 12 bytes padding | blocks ... | epilogue header (size 0, allocated) |
+
+    Allocated block: | header | payload |
+    Free block:      | header | prev | next | ... | footer |
+
+    Allocated blocks don't need a footer, the PREV_FREE bit in the header
+    of the next block says whether there is one to look at when coalescing.
+
+    The arena_* functions below are the single-threaded boundary tag heap,
+    mm_* wrap them (see the thread cache at the end of the file).
+*/
+static int
+arena_init(void) {
     heap_start = mem_sbrk(CHUNKSIZE);
     if (heap_start == (void *)-1) {
         return -1;
     }
 
-    u32 block_size = PACK(CHUNKSIZE - 2 * WSIZE, 0);
+    heap_end = heap_start + CHUNKSIZE;
 
-    u8 *bp = heap_start + 4 * WSIZE; // header, prev, next + padding for 8 byte alignment
-    assert((u32)bp % 8 == 0);
+    u8 *bp = heap_start + ALIGNMENT; // padding + header for 16 byte alignment
+    assert((uintptr_t)bp % ALIGNMENT == 0);
 
-    put(heap_start, 6 * WSIZE); // prologue padding, for calcualting prev block size
+    memset(heap_start, 0, ALIGNMENT - WSIZE);  // padding
+    put(header_field(bp), 0);                  // previous block (none) isn't free
+    put(header_field(heap_end), PACK(0, ALLOC)); // epilogue
 
-    put(header_field(bp), block_size); // header
-    put(prev_free_field(bp), 0);       // prev = 0
-    put(next_free_field(bp), 0);       // next = 0
-    put(footer_field(bp), block_size); // footer
+    memset(free_blocks, 0, sizeof(free_blocks));
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    fl_bitmap = 0;
 
-    free_blocks = bp;
+    memset(fast_bins, 0, sizeof(fast_bins));
+    fast_bin_count = 0;
 
-    heap_end = heap_start + CHUNKSIZE;
+    heap_growth = CHUNKSIZE;
+    allocs_since_growth = 0;
+
+    set_block(bp, CHUNKSIZE - ALIGNMENT, 0);
+    add_free_block(bp);
 
     check_heap_dump();
 
     return 0;
 }
 
+// free blocks never have a free block before them (they would be coalesced),
+// so the PREV_FREE bit of bp is always clear here
 static inline void
 place(void *bp, size_t size) {
     u32 block_size = get_size(header_field(bp));
 
+    remove_free_block(bp);
+
     if ((block_size - size) < MIN_FREE_SIZE) {
         // don't split
-        put(header_field(bp), PACK(block_size, 1));
-        put(footer_field(bp), PACK(block_size, 1));
-
-        remove_free_block(bp);
+        set_block(bp, block_size, ALLOC);
     } else {
         // split
-        put(header_field(bp), PACK(size, 1));
-        put(footer_field(bp), PACK(size, 1));
+        set_block(bp, size, ALLOC);
 
         u8 *split_bp = next_block_addr(bp);
 
-        put(header_field(split_bp), PACK(block_size - size, 0));
-        put(footer_field(split_bp), PACK(block_size - size, 0));
+        put(header_field(split_bp), 0);
+        set_block(split_bp, block_size - size, 0);
 
-        remove_free_block(bp);
         add_free_block(split_bp);
     }
 }
 
+// Bounded best fit in the request's own class, then the first block of the first
+// non-empty class where every block is big enough - O(1) in both cases
 static inline void *
 find_fit_place(size_t size) {
-    u8 *bp = free_blocks;
-
     u8 *best_fit = NULL;
+    u32 scanned = 0;
+
+    u8 *bp = free_blocks[size_class(size)];
+    while (scanned < FIT_SCAN_LIMIT && bp != NULL) {
+        scanned++;
 
-    while (bp != NULL) {
         u32 block_size = get_size(header_field(bp));
-        if (!is_alloc(header_field(bp)) && (block_size >= size)) {
+        if (block_size >= size) {
             if (block_size == size) {
                 best_fit = bp;
                 break;
@@ -313,7 +530,18 @@ find_fit_place(size_t size) {
         bp = next_free(bp);
     }
 
+    STAT(fit_search_length[stat_bucket(scanned)], 1);
+
+    if (best_fit == NULL) {
+        u32 class = find_non_empty_class(size_class_round_up(size));
+        if (class < NUM_CLASSES) {
+            best_fit = free_blocks[class];
+            STAT(fit_bigger_class, 1);
+        }
+    }
+
     if (best_fit == NULL) {
+        STAT(fit_failed, 1);
         return NULL;
     } else {
         place(best_fit, size);
@@ -321,66 +549,198 @@ find_fit_place(size_t size) {
     }
 }
 
-void
+int
 extend_heap(u32 size) {
     if (LOG >= 1) {
-        printf("extending by %d bytes\n", size);
+        printf("extending by %u bytes\n", size);
+    }
+
+    if ((size_t)(heap_end - heap_start) + size > MAX_HEAP_SIZE) {
+        return -1;
     }
 
     u8 *new_segment = mem_sbrk(size);
-    assert((u32)new_segment % 8 == 0);
+    if (new_segment == (void *)-1) {
+        return -1;
+    }
+    assert((uintptr_t)new_segment % ALIGNMENT == 0);
     assert(new_segment == heap_end);
 
     heap_end += size;
 
-    u32 block_size = PACK(size, 0); // subtle
+    STAT(extend_heap_calls, 1);
+    STAT(extend_heap_bytes, size);
 
-    u8 *new_block = new_segment + 2 * WSIZE;
+    // the old epilogue becomes the header of the new block
+    u8 *new_block = new_segment;
 
-    put(header_field(new_block), block_size); // header
-    put(prev_free_field(new_block), 0);       // prev = 0
-    put(next_free_field(new_block), 0);       // next = 0
-    put(footer_field(new_block), block_size); // footer
+    put(header_field(heap_end), PACK(0, ALLOC)); // new epilogue
+    set_block(new_block, size, ALLOC);
 
     coalesce(new_block);
 
     check_heap_dump();
+
+    return 0;
+}
+
+// size of the last block if it is free, an extension is merged with it
+static inline u32
+last_free_size(void) {
+    return prev_free_bit(header_field(heap_end)) ? get_size(header_field(prev_block_addr(heap_end))) : 0;
+}
+
+// Extends the heap by shortfall bytes or by some room for the next allocations,
+// whichever is more. Not by both: a block that was just copied to the end of the heap
+// keeps growing in place only if no small block gets placed right behind it.
+// The room doubles when the heap had to grow again within GROWTH_WINDOW allocations
+// and halves when it didn't, so a program that allocates fast calls mem_sbrk
+// less and less often. It's capped at a 64th of the heap, which is all that can
+// stay unused at the end of the heap.
+static int
+grow_heap(u32 shortfall) {
+    if (allocs_since_growth < GROWTH_WINDOW) {
+        heap_growth = (heap_growth < MAX_GROWTH) ? heap_growth * 2 : MAX_GROWTH;
+    } else if (heap_growth > CHUNKSIZE) {
+        heap_growth /= 2;
+    }
+    allocs_since_growth = 0;
+
+    u32 cap = (u32)((heap_end - heap_start) >> GROWTH_CAP_SHIFT) & ~(ALIGNMENT - 1);
+    u32 room = (heap_growth < cap) ? heap_growth : cap;
+    if (room < CHUNKSIZE) {
+        room = CHUNKSIZE;
+    }
+
+    if (room > shortfall && extend_heap(room) == 0) {
+        return 0;
+    }
+    return extend_heap(shortfall);
+}
+
+/*
+    Fast bins
+
+    Freeing a block means taking its free neighbours off their lists, merging
+    and putting the result on another list - wasted work when the next malloc
+    asks for the same size again, which is what request / response loops do.
+    So a freed arena block of up to FAST_BIN_MAX_SIZE bytes is just pushed onto
+    a LIFO list of blocks of exactly its size (linked through the first 4 bytes
+    of the payload) and stays allocated as far as the boundary tags go.
+    A malloc of that size pops it again.
+
+    The bins are merged into the free lists all at once, only when a fit search
+    fails, when realloc can't grow a block into its right neighbour (which may
+    be in a bin) and before the heap is extended.
+*/
+static inline void
+fast_bin_push(u8 *bp, u32 size) {
+    u32 bin = size / ALIGNMENT;
+
+    // a block that comes back out of the bin is a new block, not a realloced one
+    put(header_field(bp), *header_field(bp) & ~REALLOCED);
+
+    *(u32 *)bp = fast_bins[bin];
+    fast_bins[bin] = to_offset(bp);
+    fast_bin_count++;
+}
+
+static inline u8 *
+fast_bin_pop(u32 size) {
+    if (size > FAST_BIN_MAX_SIZE) {
+        return NULL;
+    }
+
+    u32 bin = size / ALIGNMENT;
+    u8 *bp = from_offset(fast_bins[bin]);
+
+    if (bp != NULL) {
+        fast_bins[bin] = *(u32 *)bp;
+        fast_bin_count--;
+    }
+
+    return bp;
+}
+
+// frees every block in the fast bins for real, returns 0 if they were all empty
+static u32
+consolidate_fast_bins(void) {
+    if (fast_bin_count == 0) {
+        return 0;
+    }
+
+    if (LOG >= 1) {
+        printf("consolidating %u fast bin blocks\n", fast_bin_count);
+    }
+    STAT(fast_bin_consolidations, 1);
+
+    for (u32 bin = 0; bin < FAST_BINS; bin++) {
+        u8 *bp = from_offset(fast_bins[bin]);
+        while (bp != NULL) {
+            u8 *next = from_offset(*(u32 *)bp);
+            coalesce(bp);
+            bp = next;
+        }
+    }
+
+    memset(fast_bins, 0, sizeof(fast_bins));
+    fast_bin_count = 0;
+
+    return 1;
 }
 
 size_t
 calc_block_size(size_t req_size) {
     size_t final_size = 0;
 
-    if (req_size <= DSIZE) {
+    if (req_size + WSIZE <= MIN_FREE_SIZE) {
         final_size = MIN_FREE_SIZE;
     } else {
-        // we need bp and footer to be 8-byte aligned
-        final_size = DSIZE * ((req_size + (4 * WSIZE) + (DSIZE - 1)) / DSIZE);
-        assert(final_size % 8 == 0);
+        // header + payload, bp has to stay 16-byte aligned
+        final_size = ALIGNMENT * ((req_size + WSIZE + (ALIGNMENT - 1)) / ALIGNMENT);
+        assert(final_size % ALIGNMENT == 0);
     }
 
     return final_size;
 }
 
-void *
-mm_malloc(size_t size) {
-    if (size == 0) {
+static void *
+arena_malloc(size_t size) {
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
         return NULL;
     }
 
     if (LOG >= 1) {
-        printf("alloc %d\n", (u32)size);
+        printf("alloc %zu\n", size);
     }
 
     size_t final_size = calc_block_size(size);
 
-    u8 *bp = find_fit_place(final_size);
-    if (bp == NULL) {
-        u32 ext_size = (final_size > CHUNKSIZE) ? final_size : CHUNKSIZE;
-        extend_heap(ext_size);
+    u8 *bp = fast_bin_pop(final_size);
+    if (bp != NULL) {
+        return bp;
+    }
+
+    allocs_since_growth++;
 
+    // the fast bins and the freed big blocks go back to the free lists before the heap grows
+    bp = find_fit_place(final_size);
+    if (bp == NULL && consolidate_fast_bins()) {
+        bp = find_fit_place(final_size);
+    }
+    if (bp == NULL && release_large_free_pages(final_size)) {
         bp = find_fit_place(final_size);
     }
+    if (bp == NULL) {
+        // the last block, grown by what it lacks if needed
+        u32 last_size = last_free_size();
+        if (last_size < final_size && grow_heap(final_size - last_size) < 0) {
+            return NULL;
+        }
+
+        bp = prev_block_addr(heap_end);
+        place(bp, final_size);
+    }
 
     check_heap_dump();
 
@@ -393,163 +753,1528 @@ coalesce(u8 *bp) {
         printf("coalesce\n");
     }
 
-    u32 right_in_range = (u8 *)next_block_addr(bp) < heap_end;
-    u32 left_in_range = (u8 *)prev_block_addr(bp) > heap_start;
+    // the epilogue is allocated and the first block never has PREV_FREE set,
+    // so no range checks are needed
+    u32 is_next_free = !is_alloc(next_header(bp));
+    u32 is_prev_free = prev_free_bit(header_field(bp));
 
-    u32 is_next_free = right_in_range ? !is_alloc((u32 *)next_header(bp)) : 0;
-    u32 is_prev_free = left_in_range ? !is_alloc((u32 *)prev_footer(bp)) : 0;
+    u32 size = get_size(header_field(bp));
 
-    if (!is_next_free && !is_prev_free) {
-        u32 size = get_size(header_field(bp));
-
-        put(header_field(bp), PACK(size, 0));
-        put(footer_field(bp), PACK(size, 0));
+    if (is_next_free) {
+        u8 *next_block = next_block_addr(bp);
 
-        add_free_block(bp);
-        return;
+        size += get_size(header_field(next_block));
+        remove_free_block(next_block);
     }
 
-    if (is_prev_free && is_next_free) {
-        u8 *next_block = next_block_addr(bp);
+    if (is_prev_free) {
         u8 *prev_block = prev_block_addr(bp);
 
-        u32 curr_size = get_size(header_field(bp));
-        u32 next_size = get_size(header_field(next_block));
-        u32 prev_size = get_size(header_field(prev_block));
-
-        u32 coal_size = curr_size + next_size + prev_size;
-
-        remove_free_block(next_block);
+        size += get_size(header_field(prev_block));
         remove_free_block(prev_block);
 
-        put(header_field(prev_block), PACK(coal_size, 0));
-        put(footer_field(prev_block), PACK(coal_size, 0));
-
-        add_free_block(prev_block);
-        return;
+        bp = prev_block;
     }
 
-    if (is_next_free) {
-        u8 *next_block = next_block_addr(bp);
-
-        u32 size = get_size(header_field(bp));
-        u32 next_size = get_size(next_header(bp));
-
-        u32 coal_size = size + next_size;
-
-        remove_free_block(next_block);
+    set_block(bp, size, 0);
+    add_free_block(bp);
+}
 
-        put(header_field(bp), PACK(coal_size, 0));
-        put(footer_field(bp), PACK(coal_size, 0));
+static void
+arena_free(void *_bp) {
+    u8 *bp = (u8 *)_bp;
 
-        add_free_block(bp);
+    if (bp == NULL) {
         return;
     }
 
-    if (is_prev_free) {
-        u8 *prev_block = prev_block_addr(bp);
-
-        u32 size = get_size(header_field(bp));
-        u32 prev_size = get_size(prev_header(bp));
+    if (LOG >= 1) {
+        printf("free %p\n", bp);
+    }
 
-        u32 coal_size = size + prev_size;
+    u32 size = get_size(header_field(bp));
+    if (size <= FAST_BIN_MAX_SIZE) {
+        fast_bin_push(bp, size);
+    } else {
+        coalesce(bp);
+    }
 
-        remove_free_block(prev_block);
+    check_heap_dump();
+}
 
-        put(prev_header(bp), PACK(coal_size, 0));
-        put(footer_field(bp), PACK(coal_size, 0));
+// give the end of an allocated block back, merged with the next block if that is free
+static inline void
+shrink_block(u8 *bp, u32 size) {
+    u32 block_size = get_size(header_field(bp));
 
-        add_free_block(prev_block);
+    if (block_size < size + MIN_FREE_SIZE) {
         return;
     }
-}
-
-void
-mm_free(void *_bp) {
-    u8 *bp = (u8 *)_bp;
 
-    if (LOG >= 1) {
-        printf("free 0x%x\n", (u32)bp);
-    }
+    set_block(bp, size, ALLOC);
 
-    coalesce(bp);
+    u8 *tail = next_block_addr(bp);
+    put(header_field(tail), 0);
+    set_block(tail, block_size - size, ALLOC);
 
-    check_heap_dump();
+    coalesce(tail);
 }
 
-static inline u8 *
-simple_realloc(u8 *bp, u32 size) {
-    u8 *new_bp = mm_malloc(size);
-    memcpy(new_bp, bp, size);
-    mm_free(bp);
+// A block that realloc has grown before will probably grow again,
+// so it gets a quarter more than asked for when it has to move or take space anyway
+static inline u32
+with_slack(u8 *bp, u32 size) {
+    if (!(*header_field(bp) & REALLOCED)) {
+        return size;
+    }
 
-    return new_bp;
+    u32 slack = (size / 4) & ~(ALIGNMENT - 1);
+    return (size + slack <= MAX_REQUEST_SIZE) ? size + slack : size;
 }
 
+// Grows an allocated block, trying (in this order) to take the free block on the right,
+// to extend the heap if the block is the last one, to take the free block on the left
+// (moving the data), and only then copies the data to a new block
 static inline u8 *
-expand_realloc(u8 *bp, u32 size) {
-    if (LOG >= 1) {
-        printf("realoc expanding\n");
-    }
+grow_block(u8 *bp, u32 size) {
+    u32 old_size = get_size(header_field(bp));
+    u32 wanted = with_slack(bp, size);
 
-    u32 right_in_range = (u8 *)next_block_addr(bp) < heap_end;
+    u8 *next = next_block_addr(bp);
+    u32 next_size = is_alloc(header_field(next)) ? 0 : get_size(header_field(next));
 
-    u32 is_next_free = right_in_range ? !is_alloc((u32 *)next_header(bp)) : 0;
+    // a neighbour waiting in a fast bin looks allocated, and the heap may be about to grow
+    if (old_size + next_size < size && consolidate_fast_bins()) {
+        next_size = is_alloc(header_field(next)) ? 0 : get_size(header_field(next));
+    }
 
-    // Simple extend to the right without copying
-    if (is_next_free) {
-        u8 *next_block = (u8 *)next_block_addr(bp);
+    if (old_size + next_size < size && next + next_size == heap_end) {
+        // extend_heap merges the new space with the free block on the right, if any
+        if (grow_heap(size - old_size - next_size) == 0) {
+            next_size = get_size(header_field(next));
+        }
+    }
 
-        u32 self_size = get_size(header_field(bp));
-        u32 next_size = get_size(next_header(bp));
-        u32 total_size = self_size + next_size;
+    if (old_size + next_size >= size) {
+        if (LOG >= 1) {
+            printf("realloc growing in place\n");
+        }
+        STAT(realloc_in_place, 1);
 
-        if (total_size >= size) {
-            remove_free_block(next_block);
+        if (next_size > 0) {
+            remove_free_block(next);
+            set_block(bp, old_size + next_size, ALLOC);
+        }
 
-            if ((total_size - size) < MIN_FREE_SIZE) {
-                // don't split
-                put(header_field(bp), PACK(total_size, 1));
-                put(footer_field(bp), PACK(total_size, 1));
-            } else {
-                // split
-                put(header_field(bp), PACK(size, 1));
-                put(footer_field(bp), PACK(size, 1));
+        shrink_block(bp, (wanted < old_size + next_size) ? wanted : old_size + next_size);
+        return bp;
+    }
 
-                u8 *split_bp = next_block_addr(bp);
+    if (prev_free_bit(header_field(bp))) {
+        u8 *prev = prev_block_addr(bp);
+        u32 total = get_size(header_field(prev)) + old_size + next_size;
 
-                put(header_field(split_bp), PACK(total_size - size, 0));
-                put(footer_field(split_bp), PACK(total_size - size, 0));
+        if (total >= size) {
+            if (LOG >= 1) {
+                printf("realloc moving left\n");
+            }
+            STAT(realloc_moved, 1);
 
-                add_free_block(split_bp);
+            remove_free_block(prev);
+            if (next_size > 0) {
+                remove_free_block(next);
             }
 
-            return bp;
-        } else {
-            return simple_realloc(bp, size);
+            memmove(prev, bp, old_size - WSIZE);
+            set_block(prev, total, ALLOC);
+
+            shrink_block(prev, (wanted < total) ? wanted : total);
+            return prev;
         }
-    } else {
-        return simple_realloc(bp, size);
     }
+
+    if (LOG >= 1) {
+        printf("realloc copying\n");
+    }
+
+    u8 *new_bp = arena_malloc(wanted - WSIZE);
+    if (new_bp == NULL && wanted > size) {
+        new_bp = arena_malloc(size - WSIZE);
+    }
+    if (new_bp == NULL) {
+        return NULL; // the old block stays valid
+    }
+
+    memcpy(new_bp, bp, old_size - WSIZE);
+    arena_free(bp);
+    STAT(realloc_copied, 1);
+
+    return new_bp;
 }
 
-void *
-mm_realloc(void *ptr, size_t size) {
+static void *
+arena_realloc(void *ptr, size_t size) {
     if (LOG >= 1) {
-        printf("realloc 0x%x size = %d\n", (u32)ptr, size);
+        printf("realloc %p size = %zu\n", ptr, size);
     }
 
     if (ptr == NULL) {
-        return mm_malloc(size);
+        return heap_malloc(size);
     } else if (size == 0) {
-        mm_free(ptr);
+        arena_free(ptr);
         return NULL;
-    } else {
-        u32 final_size = (u32)calc_block_size(size);
-        u8 *new_bp = expand_realloc((u8 *)ptr, final_size);
+    } else if (size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
 
-        check_heap_dump();
+    u8 *bp = (u8 *)ptr;
+    u32 final_size = (u32)calc_block_size(size);
 
-        return new_bp;
+    if (final_size <= get_size(header_field(bp))) {
+        // a block with slack keeps it, any other block gives the rest back
+        shrink_block(bp, with_slack(bp, final_size));
+        STAT(realloc_in_place, 1);
+    } else {
+        bp = grow_block(bp, final_size);
+        if (bp != NULL) {
+            put(header_field(bp), *header_field(bp) | REALLOCED);
+        }
     }
+
+    check_heap_dump();
+
+    return bp;
+}
+
+/*
+    Slab path for small requests (<= SLAB_MAX_SIZE bytes)
+
+    Small blocks are served from runs: page-aligned, page-sized arena blocks cut
+    into equal slots, one run size class per ALIGNMENT step. A slot has no header,
+    so a 16 byte request really takes 16 bytes, and malloc / free is just popping /
+    pushing the run's embedded free list.
+
+    Run metadata lives at the start of the run's page, so it is found from a slot
+    address by masking. Whether a pointer is a slot at all is answered by
+    slab_pages, one bit per page of the heap.
+
+    A run is an arena block of exactly RUN_SIZE bytes, starting with the header
+    4 bytes before the page. The next block's header takes the last 4 bytes of
+    the page, so runs can be packed back to back.
+
+    | header | slab_run_t | slot | slot | ... | next header |
+
+    A class starts out in the arena: as long as it has fewer live blocks than
+    fit in a run, its requests get boundary tag blocks, because a run that holds
+    a few slots is mostly an empty page. The arena blocks are counted by
+    block size, so only roughly, and freeing one that wasn't counted is harmless.
+
+    Freed slots don't go back to their runs right away. Every class keeps up to
+    SLOT_CACHE_SIZE of them on a stack of its own, and the next request of the
+    class takes the last one, without touching a run header. Once the heap is
+    bigger than the L1 cache, the header and free list of the run a slot belongs
+    to are rarely still cached, and a free / malloc pair through them costs two
+    misses that the arena's fast bins don't have. Half of a full stack goes back
+    to the runs at once. In thread-safe mode the tcache does the same thing.
+
+    In thread-safe mode every class has a lock of its own, the runs and slots of
+    a class are only touched under it. The arena is locked inside it to create
+    or release a run, never the other way round.
+*/
+
+#define SLAB_MAX_SIZE 64
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define RUN_SIZE 4096
+#define RUN_HEADER_SIZE 32 // sizeof(slab_run_t) rounded up to ALIGNMENT
+#define SLOT_CACHE_SIZE 32 // freed slots a class keeps out of its runs, single-threaded only
+#define MAX_HEAP_PAGES ((size_t)UINT32_MAX / RUN_SIZE + 2)
+
+typedef struct slab_run_t {
+    u32 slot_size;
+    u32 used;        // slots handed out
+    u32 free_slot;   // offset of the first free slot in the run, 0 = none
+    u32 unused_slot; // offset of the first slot that was never used
+    u32 prev;        // list of runs with free slots of the class, offsets from heap_start
+    u32 next;
+} slab_run_t;
+
+static u8 *slab_runs[SLAB_CLASSES];         // runs that have a free slot
+static u32 slab_pages[MAX_HEAP_PAGES / 32]; // bit set = the page is a run
+static size_t slab_pages_used = 0;          // words of slab_pages that may be non-zero
+static u32 class_slots[SLAB_CLASSES];       // slots handed out
+static u32 class_arena_blocks[SLAB_CLASSES]; // live arena blocks of slab sizes, changed under the arena lock
+
+#ifndef MM_THREAD_SAFE
+static u32 slot_cache[SLAB_CLASSES];       // freed slots, offsets from heap_start
+static u32 slot_cache_count[SLAB_CLASSES]; // they are still counted as handed out
+#endif
+
+#ifdef MM_THREAD_SAFE
+static pthread_mutex_t slab_mutexes[SLAB_CLASSES] = {[0 ... SLAB_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER};
+static void arena_lock(void);
+static void arena_unlock(void);
+#else
+static inline void
+arena_lock(void) {}
+
+static inline void
+arena_unlock(void) {}
+#endif
+
+static inline u32
+slab_class(size_t size) {
+    return (size - 1) / ALIGNMENT;
+}
+
+static inline size_t
+page_index(u8 *bp) {
+    return ((uintptr_t)bp - ((uintptr_t)heap_start & ~(uintptr_t)(RUN_SIZE - 1))) / RUN_SIZE;
 }
+
+static inline u8 *
+page_addr(size_t page) {
+    return (u8 *)(((uintptr_t)heap_start & ~(uintptr_t)(RUN_SIZE - 1)) + page * RUN_SIZE);
+}
+
+// bp has to be a block of this heap. slab_pages is read without the lock
+// in thread-safe mode, hence the atomics
+static inline u32
+is_slab(u8 *bp) {
+    size_t page = page_index(bp);
+    return (__atomic_load_n(&slab_pages[page / 32], __ATOMIC_RELAXED) >> (page % 32)) & 1;
+}
+
+static inline slab_run_t *
+slab_run(u8 *bp) {
+    return (slab_run_t *)((uintptr_t)bp & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+static inline u32
+slots_per_run(u32 class) {
+    return (RUN_SIZE - WSIZE - RUN_HEADER_SIZE) / ((class + 1) * ALIGNMENT);
+}
+
+static inline u32
+use_slab(u32 class) {
+    u32 arena_blocks = __atomic_load_n(&class_arena_blocks[class], __ATOMIC_RELAXED);
+    return slab_runs[class] != NULL || class_slots[class] + arena_blocks >= slots_per_run(class);
+}
+
+// the class whose requests get arena blocks of this size, -1 for bigger blocks
+static inline int
+arena_block_class(u32 block_size) {
+    if (block_size > calc_block_size(SLAB_MAX_SIZE)) {
+        return -1;
+    }
+    return slab_class((block_size - WSIZE < SLAB_MAX_SIZE) ? block_size - WSIZE : SLAB_MAX_SIZE);
+}
+
+static inline u32
+is_run_full(slab_run_t *run) {
+    return run->free_slot == 0 && run->unused_slot + run->slot_size > RUN_SIZE - WSIZE;
+}
+
+static void
+add_partial_run(slab_run_t *run) {
+    u8 **runs = &slab_runs[slab_class(run->slot_size)];
+
+    run->prev = 0;
+    run->next = to_offset(*runs);
+    if (*runs != NULL) {
+        ((slab_run_t *)*runs)->prev = to_offset((u8 *)run);
+    }
+    *runs = (u8 *)run;
+}
+
+static void
+remove_partial_run(slab_run_t *run) {
+    slab_run_t *prev = (slab_run_t *)from_offset(run->prev);
+    slab_run_t *next = (slab_run_t *)from_offset(run->next);
+
+    if (prev != NULL) {
+        prev->next = run->next;
+    } else {
+        slab_runs[slab_class(run->slot_size)] = (u8 *)next;
+    }
+
+    if (next != NULL) {
+        next->prev = run->prev;
+    }
+}
+
+static slab_run_t *
+init_run(u8 *run, u32 slot_size) {
+    slab_run_t *r = (slab_run_t *)run;
+    r->slot_size = slot_size;
+    r->used = 0;
+    r->free_slot = 0;
+    r->unused_slot = RUN_HEADER_SIZE;
+
+    add_partial_run(r);
+
+    return r;
+}
+
+// The first page-aligned payload at or after bp that leaves either nothing
+// or a whole free block in front of it
+static inline u8 *
+page_start(u8 *bp) {
+    u8 *page = (u8 *)(((uintptr_t)bp + RUN_SIZE - 1) & ~(uintptr_t)(RUN_SIZE - 1));
+    if (page != bp && (u32)(page - bp) < MIN_FREE_SIZE) {
+        page += RUN_SIZE;
+    }
+    return page;
+}
+
+// where a page-aligned block of size bytes goes in the free block bp, NULL if it doesn't fit
+static inline u8 *
+page_place(u8 *bp, u32 size) {
+    u8 *page = page_start(bp);
+    return (page + size <= next_block_addr(bp)) ? page : NULL;
+}
+
+// A free block that can hold a page-aligned block: bounded scan of the classes
+// from size up, then the first block of a class where every block is big enough
+static u8 *
+find_page_fit(u32 size) {
+    u32 scanned = 0;
+    u32 class = find_non_empty_class(size_class(size));
+
+    while (class < NUM_CLASSES && scanned < FIT_SCAN_LIMIT) {
+        for (u8 *bp = free_blocks[class]; bp != NULL && scanned < FIT_SCAN_LIMIT; bp = next_free(bp)) {
+            if (page_place(bp, size) != NULL) {
+                return bp;
+            }
+            scanned++;
+        }
+
+        class = (class + 1 < NUM_CLASSES) ? find_non_empty_class(class + 1) : NUM_CLASSES;
+    }
+
+    class = find_non_empty_class(size_class_round_up(size + RUN_SIZE + MIN_FREE_SIZE));
+    return (class < NUM_CLASSES) ? free_blocks[class] : NULL;
+}
+
+// Carves an allocated block of size bytes (a multiple of RUN_SIZE) starting at a page
+// out of a free block, what is left in front of and after it stays free. The heap is
+// extended only as far as the block needs, so blocks created one after the other
+// are packed back to back.
+static u8 *
+alloc_pages(u32 size) {
+    allocs_since_growth++;
+
+    u8 *bp = find_page_fit(size);
+    if (bp == NULL && consolidate_fast_bins()) {
+        bp = find_page_fit(size);
+    }
+    // a slab run can take freed big blocks, a big block takes only whole ones (large_malloc)
+    if (bp == NULL && size == RUN_SIZE && release_large_free_pages(size)) {
+        bp = find_page_fit(size);
+    }
+
+    if (bp == NULL) {
+        // the new space is merged with the last block if that one is free
+        u8 *last = prev_free_bit(header_field(heap_end)) ? prev_block_addr(heap_end) : heap_end;
+        u8 *end = page_start(last) + size;
+
+        if (end > heap_end && grow_heap(end - heap_end) < 0) {
+            return NULL;
+        }
+        bp = last;
+    }
+
+    u8 *page = page_place(bp, size);
+    u32 front = page - bp;
+    u32 tail = next_block_addr(bp) - (page + size);
+
+    remove_free_block(bp);
+
+    if (front > 0) {
+        put(header_field(page), 0);
+        set_block(bp, front, 0);
+        add_free_block(bp);
+    }
+
+    set_block(page, size, ALLOC);
+
+    if (tail > 0) {
+        u8 *tail_bp = page + size;
+        put(header_field(tail_bp), 0);
+        set_block(tail_bp, tail, 0);
+        add_free_block(tail_bp);
+    }
+
+    return page;
+}
+
+static slab_run_t *
+new_run(u32 slot_size) {
+    arena_lock();
+
+    u8 *run = alloc_pages(RUN_SIZE);
+    if (run != NULL) {
+        size_t page = page_index(run);
+        __atomic_fetch_or(&slab_pages[page / 32], 1u << (page % 32), __ATOMIC_RELAXED);
+        if (page / 32 + 1 > slab_pages_used) {
+            slab_pages_used = page / 32 + 1;
+        }
+    }
+
+    arena_unlock();
+
+    return (run != NULL) ? init_run(run, slot_size) : NULL;
+}
+
+static void
+release_run(slab_run_t *run) {
+    remove_partial_run(run);
+
+    size_t page = page_index((u8 *)run);
+    __atomic_fetch_and(&slab_pages[page / 32], ~(1u << (page % 32)), __ATOMIC_RELAXED);
+
+    arena_lock();
+    arena_free(run);
+    arena_unlock();
+}
+
+static void *
+slab_arena_malloc(size_t size) {
+    u8 *bp = arena_malloc(size);
+
+    if (bp != NULL) {
+        int class = arena_block_class(get_size(header_field(bp)));
+        if (class >= 0) {
+            u32 count = __atomic_load_n(&class_arena_blocks[class], __ATOMIC_RELAXED);
+            __atomic_store_n(&class_arena_blocks[class], count + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return bp;
+}
+
+// bp is an arena block that is about to be freed or resized
+static inline void
+slab_forget_arena_block(u8 *bp) {
+    int class = arena_block_class(get_size(header_field(bp)));
+
+    if (class >= 0) {
+        u32 count = __atomic_load_n(&class_arena_blocks[class], __ATOMIC_RELAXED);
+        if (count > 0) {
+            __atomic_store_n(&class_arena_blocks[class], count - 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *
+slab_malloc(size_t size) {
+    u32 class = slab_class(size);
+
+#ifndef MM_THREAD_SAFE
+    u8 *cached = from_offset(slot_cache[class]);
+    if (cached != NULL) {
+        slot_cache[class] = *(u32 *)cached;
+        slot_cache_count[class]--;
+        return cached;
+    }
+#endif
+
+    slab_run_t *run = (slab_run_t *)slab_runs[class];
+
+    if (run == NULL) {
+        run = new_run((class + 1) * ALIGNMENT);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    u8 *slot;
+    if (run->free_slot != 0) {
+        slot = (u8 *)run + run->free_slot;
+        run->free_slot = *(u32 *)slot;
+    } else {
+        slot = (u8 *)run + run->unused_slot;
+        run->unused_slot += run->slot_size;
+    }
+
+    run->used++;
+    class_slots[class]++;
+
+    if (is_run_full(run)) {
+        remove_partial_run(run);
+    }
+
+    return slot;
+}
+
+static void
+run_free(slab_run_t *run, u8 *bp) {
+    if (is_run_full(run)) {
+        add_partial_run(run);
+    }
+
+    *(u32 *)bp = run->free_slot;
+    run->free_slot = bp - (u8 *)run;
+    run->used--;
+    class_slots[slab_class(run->slot_size)]--;
+
+    // keep the last partial run of a class around, so that a malloc / free
+    // pair on an empty class doesn't create and release a run every time
+    if (run->used == 0 && (slab_runs[slab_class(run->slot_size)] != (u8 *)run || run->next != 0)) {
+        release_run(run);
+    }
+}
+
+static void
+slab_free(u8 *bp) {
+    slab_run_t *run = slab_run(bp);
+
+#ifndef MM_THREAD_SAFE
+    u32 class = slab_class(run->slot_size);
+
+    if (slot_cache_count[class] == SLOT_CACHE_SIZE) {
+        for (u32 i = 0; i < SLOT_CACHE_SIZE / 2; i++) {
+            u8 *slot = from_offset(slot_cache[class]);
+            slot_cache[class] = *(u32 *)slot;
+            run_free(slab_run(slot), slot);
+        }
+        slot_cache_count[class] -= SLOT_CACHE_SIZE / 2;
+    }
+
+    *(u32 *)bp = slot_cache[class];
+    slot_cache[class] = to_offset(bp);
+    slot_cache_count[class]++;
+#else
+    run_free(run, bp);
+#endif
+}
+
+/*
+    Large path for requests of at least mm_large_threshold bytes
+
+    A big block is a page-aligned arena block of whole pages, carved out the same
+    way as a slab run. Its header has the LARGE bit, and it never goes back to the
+    free lists when it is freed. Its pages are marked in large_free_pages instead
+    and are reused, as whole pages, only by other big blocks. Neighbouring freed
+    big blocks are fused when a request needs their pages, so no coalescing is
+    needed on free, and the free lists stay clear of huge blocks that are split
+    by every small request and then can't hold the next big one.
+
+    A freed big block at the end of the heap is given back to the arena, and so
+    are the others when the free lists can't serve a request any more
+    (release_large_free_pages).
+
+    | header | payload ... | next header |
+             ^ page                      ^ page
+*/
+
+#define LARGE_THRESHOLD (64 * 1024)
+// the slab sizes and the sizes the thread caches keep (TCACHE_MAX_SIZE) are never large
+#define LARGE_MIN_THRESHOLD 1024
+
+size_t mm_large_threshold = LARGE_THRESHOLD;
+
+static u32 large_free_pages[MAX_HEAP_PAGES / 32]; // bit set = the page belongs to a freed big block
+static size_t large_pages_used = 0;               // words of large_free_pages that may be non-zero
+static size_t large_free_count = 0;               // bits set in large_free_pages
+
+static inline u32
+is_large(u8 *bp) {
+    return *header_field(bp) & LARGE;
+}
+
+static inline u32
+is_large_free_page(size_t page) {
+    return (large_free_pages[page / 32] >> (page % 32)) & 1;
+}
+
+static void
+mark_large_free(u8 *bp, u32 size, u32 free) {
+    size_t first = page_index(bp);
+
+    for (size_t page = first; page < first + size / RUN_SIZE; page++) {
+        if (free) {
+            large_free_pages[page / 32] |= 1u << (page % 32);
+        } else {
+            large_free_pages[page / 32] &= ~(1u << (page % 32));
+        }
+    }
+
+    large_free_count = free ? large_free_count + size / RUN_SIZE : large_free_count - size / RUN_SIZE;
+
+    if (free && (first + size / RUN_SIZE - 1) / 32 + 1 > large_pages_used) {
+        large_pages_used = (first + size / RUN_SIZE - 1) / 32 + 1;
+    }
+}
+
+// The first run of count free pages, a word of the bitmap at a time
+static u8 *
+find_large_free_pages(size_t count) {
+    if (large_free_count < count) {
+        return NULL;
+    }
+
+    size_t run = 0;
+    for (size_t w = 0; w < large_pages_used; w++) {
+        u32 word = large_free_pages[w];
+
+        if (word == 0) {
+            run = 0;
+        } else if (word == ~0u) {
+            run += 32;
+        } else {
+            // the run from the previous word goes on with the lowest free pages
+            u32 low = __builtin_ctz(~word);
+            if (run + low >= count) {
+                return page_addr(w * 32 - run);
+            }
+
+            if (count <= 32) {
+                // bit i stays set if pages i .. i + count - 1 are free
+                u32 starts = word;
+                u32 len = 1;
+                while (len * 2 <= count) {
+                    starts &= starts >> len;
+                    len *= 2;
+                }
+                starts &= starts >> (count - len);
+
+                if (starts != 0) {
+                    return page_addr(w * 32 + __builtin_ctz(starts));
+                }
+            }
+
+            // the free pages at the top of the word start a new run
+            run = __builtin_clz(~word);
+        }
+
+        if (run >= count) {
+            return page_addr((w + 1) * 32 - run);
+        }
+    }
+
+    return NULL;
+}
+
+// Makes the block bp size bytes big, from the freed big blocks right after it.
+// Whatever is left of the last one stays a freed big block.
+static void
+take_large_free_pages(u8 *bp, u32 size) {
+    u8 *end = bp + size;
+    u8 *blocks_end = next_block_addr(bp);
+    while (blocks_end < end) {
+        blocks_end = next_block_addr(blocks_end);
+    }
+
+    // bp itself is one of them in large_malloc, but not in large_realloc
+    u8 *taken = is_large_free_page(page_index(bp)) ? bp : next_block_addr(bp);
+    mark_large_free(taken, end - taken, 0);
+
+    set_block(bp, size, ALLOC);
+    put(header_field(bp), *header_field(bp) | LARGE);
+
+    if (blocks_end > end) {
+        put(header_field(end), 0);
+        set_block(end, blocks_end - end, ALLOC);
+        put(header_field(end), *header_field(end) | LARGE);
+    }
+}
+
+static void
+release_large(u8 *bp) {
+    if (next_block_addr(bp) != heap_end) {
+        mark_large_free(bp, get_size(header_field(bp)), 1);
+        return;
+    }
+
+    // the end of the heap goes back to the arena, with the freed big blocks in front of it
+    size_t first = page_index(bp);
+    while (first > 0 && is_large_free_page(first - 1)) {
+        first--;
+    }
+
+    u8 *block = page_addr(first);
+    mark_large_free(block, bp - block, 0);
+
+    while (block != heap_end) {
+        u8 *next = next_block_addr(block);
+        arena_free(block);
+        block = next;
+    }
+}
+
+// Gives freed big blocks back to the arena, so that a malloc the free lists can't
+// serve takes their pages instead of growing the heap: the smallest run of them
+// that holds size bytes, the rest stays for big blocks. Returns 0 if there is none.
+static u32
+release_large_free_pages(u32 size) {
+    if (large_free_count == 0) {
+        return 0;
+    }
+
+    u8 *best = NULL;
+    u32 best_size = 0;
+
+    size_t page = 0;
+    while (page < large_pages_used * 32) {
+        if (large_free_pages[page / 32] == 0) {
+            page = (page / 32 + 1) * 32;
+        } else if (!is_large_free_page(page)) {
+            page++;
+        } else {
+            u8 *run = page_addr(page);
+            u32 run_size = 0;
+            while (is_large_free_page(page)) {
+                u32 block_size = get_size(header_field(page_addr(page)));
+                run_size += block_size;
+                page += block_size / RUN_SIZE;
+            }
+
+            if (run_size >= size && (best == NULL || run_size < best_size)) {
+                best = run;
+                best_size = run_size;
+            }
+        }
+    }
+
+    if (best == NULL) {
+        return 0;
+    }
+
+    mark_large_free(best, best_size, 0);
+    for (u8 *bp = best; bp < best + best_size;) {
+        u8 *next = next_block_addr(bp);
+        arena_free(bp);
+        bp = next;
+    }
+
+    return 1;
+}
+
+static inline size_t
+large_threshold(void) {
+    return (mm_large_threshold > LARGE_MIN_THRESHOLD) ? mm_large_threshold : LARGE_MIN_THRESHOLD;
+}
+
+static inline u32
+large_block_size(size_t size) {
+    return (size + WSIZE + RUN_SIZE - 1) & ~(RUN_SIZE - 1);
+}
+
+static void *
+large_malloc(size_t size) {
+    u32 block_size = large_block_size(size);
+
+    if (LOG >= 1) {
+        printf("large alloc %zu, %u pages\n", size, block_size / RUN_SIZE);
+    }
+
+    u8 *bp = find_large_free_pages(block_size / RUN_SIZE);
+    if (bp != NULL) {
+        take_large_free_pages(bp, block_size);
+        return bp;
+    }
+
+    bp = alloc_pages(block_size);
+    if (bp != NULL) {
+        put(header_field(bp), *header_field(bp) | LARGE);
+    }
+
+    return bp;
+}
+
+// Shrinks by freeing the last pages, grows in place over freed big blocks after it
+// or by extending the heap. Returns NULL if the block has to move.
+// A block that has been grown before keeps a quarter more, like in arena_realloc.
+static void *
+large_realloc(u8 *bp, size_t size) {
+    u32 old_size = get_size(header_field(bp));
+    u32 new_size = large_block_size(size);
+    u32 wanted = large_block_size(with_slack(bp, size));
+
+    if (wanted < old_size) {
+        u32 realloced = *header_field(bp) & REALLOCED;
+
+        u8 *rest = bp + wanted;
+        put(header_field(rest), 0);
+        set_block(rest, old_size - wanted, ALLOC);
+        put(header_field(rest), *header_field(rest) | LARGE);
+        set_block(bp, wanted, ALLOC);
+        put(header_field(bp), *header_field(bp) | LARGE | realloced);
+
+        release_large(rest);
+    } else if (new_size > old_size) {
+        size_t first = page_index(bp + old_size);
+        size_t count = (new_size - old_size) / RUN_SIZE;
+        size_t page = first;
+        while (page < first + count && page < large_pages_used * 32 && is_large_free_page(page)) {
+            page++;
+        }
+
+        if (page == first + count) {
+            take_large_free_pages(bp, new_size);
+        } else if (page == first && bp + old_size == heap_end) {
+            consolidate_fast_bins();
+
+            if (extend_heap(wanted - old_size) < 0) {
+                wanted = new_size;
+                if (extend_heap(new_size - old_size) < 0) {
+                    return NULL;
+                }
+            }
+
+            u8 *next = bp + old_size;
+            remove_free_block(next);
+            set_block(bp, wanted, ALLOC);
+            put(header_field(bp), *header_field(bp) | LARGE);
+        } else {
+            return NULL;
+        }
+
+        put(header_field(bp), *header_field(bp) | REALLOCED);
+    }
+
+    return bp;
+}
+
+/*
+    heap_* - the whole single-threaded allocator, small requests go to the slab
+    path, big ones to the large path and everything else to the boundary tag arena
+*/
+static int
+heap_init(void) {
+    memset(slab_runs, 0, sizeof(slab_runs));
+    memset(slab_pages, 0, slab_pages_used * sizeof(u32));
+    slab_pages_used = 0;
+    memset(class_slots, 0, sizeof(class_slots));
+    memset(class_arena_blocks, 0, sizeof(class_arena_blocks));
+#ifndef MM_THREAD_SAFE
+    memset(slot_cache, 0, sizeof(slot_cache));
+    memset(slot_cache_count, 0, sizeof(slot_cache_count));
+#endif
+
+    memset(large_free_pages, 0, large_pages_used * sizeof(u32));
+    large_pages_used = 0;
+    large_free_count = 0;
+
+    return arena_init();
+}
+
+static void *
+heap_malloc(size_t size) {
+    if (size != 0 && size <= SLAB_MAX_SIZE) {
+        if (use_slab(slab_class(size))) {
+            STAT(slab_mallocs, 1);
+            return slab_malloc(size);
+        }
+        STAT(arena_mallocs, 1);
+        return slab_arena_malloc(size);
+    } else if (size >= large_threshold() && size <= MAX_REQUEST_SIZE) {
+        STAT(large_mallocs, 1);
+        return large_malloc(size);
+    }
+    STAT(arena_mallocs, 1);
+    return arena_malloc(size);
+}
+
+static void
+heap_free(void *_bp) {
+    u8 *bp = (u8 *)_bp;
+
+    if (bp == NULL) {
+        return;
+    }
+
+    if (is_slab(bp)) {
+        slab_free(bp);
+    } else if (is_large(bp)) {
+        release_large(bp);
+    } else {
+        slab_forget_arena_block(bp);
+        arena_free(bp);
+    }
+}
+
+static void *
+heap_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return heap_malloc(size);
+    } else if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    } else if (size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    u8 *bp = (u8 *)ptr;
+    u32 large = size >= large_threshold();
+    size_t old_size;
+
+    if (is_slab(bp)) {
+        old_size = slab_run(bp)->slot_size;
+        if (size <= old_size) {
+            STAT(realloc_in_place, 1);
+            return bp;
+        }
+    } else if (is_large(bp)) {
+        old_size = get_size(header_field(bp)) - WSIZE;
+        if (large && large_realloc(bp, size) != NULL) {
+            STAT(realloc_in_place, 1);
+            return bp;
+        }
+    } else if (!large || (*header_field(bp) & REALLOCED)) {
+        // a block that realloc keeps growing stays in the arena, where it can
+        // grow into its free neighbours step by step
+        slab_forget_arena_block(bp);
+        return arena_realloc(bp, size);
+    } else {
+        old_size = get_size(header_field(bp)) - WSIZE;
+    }
+
+    // the block changes paths (or a big one can't grow in place),
+    // a block that keeps growing gets slack wherever it goes
+    u32 growing = size > old_size && !is_slab(bp);
+    u8 *new_bp = growing ? heap_malloc(with_slack(bp, size)) : NULL;
+    if (new_bp == NULL) {
+        new_bp = heap_malloc(size);
+    }
+    if (new_bp == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_bp, bp, (old_size < size) ? old_size : size);
+    if (growing && !is_slab(new_bp)) {
+        put(header_field(new_bp), *header_field(new_bp) | REALLOCED);
+    }
+    heap_free(bp);
+    STAT(realloc_copied, 1);
+
+    return new_bp;
+}
+
+#ifndef MM_THREAD_SAFE
+
+int
+mm_init(void) {
+    return heap_init();
+}
+
+void *
+mm_malloc(size_t size) {
+    STAT(malloc_calls, 1);
+    return heap_malloc(size);
+}
+
+void
+mm_free(void *bp) {
+    STAT(free_calls, 1);
+    heap_free(bp);
+}
+
+void *
+mm_realloc(void *ptr, size_t size) {
+    STAT(realloc_calls, 1);
+    return heap_realloc(ptr, size);
+}
+
+#else
+
+/*
+    Thread-safe mode (-DMM_THREAD_SAFE)
+
+    The heap above is shared. The boundary tag arena (with the large path) is
+    protected by arena_mutex, the runs of every slab class by a lock of their
+    own (slab_mutexes), so slots of different classes and arena blocks are
+    handed out and taken back in parallel. A thread that holds a class lock may
+    take arena_mutex, never the other way round: slots never go through heap_*
+    under arena_mutex, the thread caches move them to and from the runs directly.
+    In front of it all, every thread has a cache of small blocks
+    (tcache), one LIFO list per block size, slab slots get bins of their own.
+    Cached blocks stay allocated as far as the heap is concerned, so malloc / free
+    of a cached size doesn't need the lock at all.
+
+    An empty bin is refilled with TCACHE_BATCH blocks under one lock, a full
+    bin gives TCACHE_BATCH blocks back the same way. A block freed by another
+    thread than the one that allocated it simply goes into the freeing thread's
+    cache, there is only one arena to return it to.
+
+    When a flush (or the free of a big block) can't get the lock immediately,
+    the blocks are pushed onto a lock-free deferred free list instead, and
+    whoever takes the lock next frees them. So a free never waits for a malloc
+    in another thread that is busy extending the heap.
+
+    mm_init must be called before any other thread uses the allocator.
+*/
+
+#define TCACHE_MAX_SIZE 1024 // biggest block size (bytes) cached per thread
+#if TCACHE_MAX_SIZE > LARGE_MIN_THRESHOLD
+#error "cached block sizes must not be large"
+#endif
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1) // slot_size / ALIGNMENT for slots
+#define TCACHE_COUNT 32 // max blocks per bin
+#define TCACHE_BATCH 16 // blocks moved between a bin and the arena at once
+
+typedef struct tcache_t {
+    u8 *bins[TCACHE_BINS]; // linked through the first 8 bytes of the payload
+    u32 counts[TCACHE_BINS];
+    u32 generation; // the caches of an older mm_init are stale
+} tcache_t;
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static u32 arena_generation = 0;
+static u8 *deferred_frees = NULL;
+
+static __thread tcache_t tcache;
+
+static inline u8 *
+cached_next(u8 *bp) {
+    return *(u8 **)bp;
+}
+
+static inline void
+set_cached_next(u8 *bp, u8 *next) {
+    *(u8 **)bp = next;
+}
+
+static void
+drain_deferred_frees(void) {
+    u8 *bp = __atomic_exchange_n(&deferred_frees, NULL, __ATOMIC_ACQUIRE);
+
+    while (bp != NULL) {
+        u8 *next = cached_next(bp);
+        heap_free(bp);
+        bp = next;
+    }
+}
+
+static inline void
+arena_lock(void) {
+    pthread_mutex_lock(&arena_mutex);
+    drain_deferred_frees();
+}
+
+static inline void
+arena_unlock(void) {
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+// push a list of blocks (first..last) onto the deferred free list
+static inline void
+defer_frees(u8 *first, u8 *last) {
+    u8 *head = __atomic_load_n(&deferred_frees, __ATOMIC_RELAXED);
+    do {
+        set_cached_next(last, head);
+    } while (!__atomic_compare_exchange_n(
+        &deferred_frees, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Frees the slots among n cached blocks first..last under the lock of their class
+// and relinks the other ones (arena blocks in a slot bin, see mm_free) into
+// first..last. Returns how many of those are left.
+static u32
+slab_flush(u32 class, u8 **first, u8 **last, u32 n) {
+    u8 *bp = *first;
+    u8 *kept = NULL;
+    u32 kept_count = 0;
+
+    pthread_mutex_lock(&slab_mutexes[class]);
+
+    for (u32 i = 0; i < n; i++) {
+        u8 *next = cached_next(bp);
+        if (is_slab(bp)) {
+            slab_free(bp);
+        } else {
+            if (kept == NULL) {
+                *last = bp;
+            }
+            set_cached_next(bp, kept);
+            kept = bp;
+            kept_count++;
+        }
+        bp = next;
+    }
+
+    pthread_mutex_unlock(&slab_mutexes[class]);
+
+    *first = kept;
+    return kept_count;
+}
+
+// give up to count blocks of a bin back to the heap
+static void
+tcache_flush(u32 bin, u32 count) {
+    u8 *first = tcache.bins[bin];
+    u8 *last = first;
+
+    if (first == NULL) {
+        return;
+    }
+
+    u32 n = 1;
+    while (n < count && cached_next(last) != NULL) {
+        last = cached_next(last);
+        n++;
+    }
+
+    tcache.bins[bin] = cached_next(last);
+    tcache.counts[bin] -= n;
+
+    if (bin <= SLAB_CLASSES) {
+        n = slab_flush(bin - 1, &first, &last, n);
+        if (n == 0) {
+            return;
+        }
+    }
+
+    if (pthread_mutex_trylock(&arena_mutex) != 0) {
+        defer_frees(first, last);
+        return;
+    }
+
+    drain_deferred_frees();
+
+    u8 *bp = first;
+    for (u32 i = 0; i < n; i++) {
+        u8 *next = cached_next(bp);
+        heap_free(bp);
+        bp = next;
+    }
+
+    arena_unlock();
+}
+
+// thread exit - return everything to the arena
+static void
+tcache_destroy(void *unused) {
+    (void)unused;
+
+    if (tcache.generation != arena_generation) {
+        return;
+    }
+
+    for (u32 bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache_flush(bin, tcache.counts[bin]);
+    }
+}
+
+static void
+tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static inline void
+tcache_check(void) {
+    u32 generation = __atomic_load_n(&arena_generation, __ATOMIC_ACQUIRE);
+
+    if (tcache.generation != generation) {
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.generation = generation;
+        pthread_setspecific(tcache_key, &tcache); // non-NULL, so the destructor runs
+    }
+}
+
+static void
+tcache_refill(u32 bin, size_t size) {
+    u32 class = slab_class(size);
+    u32 slab = 0;
+
+    // a slot bin is refilled from the runs under the class lock,
+    // with arena blocks while the class has no runs
+    if (size <= SLAB_MAX_SIZE) {
+        pthread_mutex_lock(&slab_mutexes[class]);
+        slab = use_slab(class);
+        if (!slab) {
+            pthread_mutex_unlock(&slab_mutexes[class]);
+        }
+    }
+    if (!slab) {
+        arena_lock();
+    }
+
+    for (u32 i = 0; i < TCACHE_BATCH; i++) {
+        u8 *bp;
+        if (slab) {
+            STAT(slab_mallocs, 1);
+            bp = slab_malloc(size);
+        } else if (size <= SLAB_MAX_SIZE) {
+            STAT(arena_mallocs, 1);
+            bp = slab_arena_malloc(size);
+        } else {
+            bp = heap_malloc(size);
+        }
+        if (bp == NULL) {
+            break;
+        }
+
+        set_cached_next(bp, tcache.bins[bin]);
+        tcache.bins[bin] = bp;
+        tcache.counts[bin]++;
+    }
+
+    if (slab) {
+        pthread_mutex_unlock(&slab_mutexes[class]);
+    } else {
+        arena_unlock();
+    }
+}
+
+int
+mm_init(void) {
+    pthread_once(&tcache_key_once, tcache_key_create);
+
+    pthread_mutex_lock(&arena_mutex);
+
+    deferred_frees = NULL;
+    int result = heap_init();
+    // generation 0 is what a fresh thread's cache has
+    __atomic_store_n(&arena_generation, arena_generation + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&arena_mutex);
+
+    return result;
+}
+
+void *
+mm_malloc(size_t size) {
+    STAT(malloc_calls, 1);
+
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    u32 block_size = calc_block_size(size);
+
+    if (block_size <= TCACHE_MAX_SIZE) {
+        // a slot bin is refilled with requests of the slot size,
+        // an arena bin with the largest request that gets that block size
+        u32 bin = (size <= SLAB_MAX_SIZE) ? slab_class(size) + 1 : block_size / ALIGNMENT;
+
+        tcache_check();
+
+        if (tcache.bins[bin] == NULL) {
+            tcache_refill(bin, (size <= SLAB_MAX_SIZE) ? bin * ALIGNMENT : block_size - WSIZE);
+        }
+
+        u8 *bp = tcache.bins[bin];
+        if (bp != NULL) {
+            tcache.bins[bin] = cached_next(bp);
+            tcache.counts[bin]--;
+        }
+
+        return bp;
+    }
+
+    arena_lock();
+    void *bp = heap_malloc(size);
+    arena_unlock();
+
+    return bp;
+}
+
+void
+mm_free(void *_bp) {
+    u8 *bp = (u8 *)_bp;
+
+    STAT(free_calls, 1);
+
+    if (bp == NULL) {
+        return;
+    }
+
+    // the run of a live slot can't go away, so its slot size can be read unlocked
+    u32 bin = 0;
+    if (is_slab(bp)) {
+        bin = slab_run(bp)->slot_size / ALIGNMENT;
+    } else {
+        // see put_atomic
+        u32 block_size = __atomic_load_n(header_field(bp), __ATOMIC_RELAXED) & ~(ALIGNMENT - 1);
+
+        // arena blocks the size of a slot (small requests of a class without
+        // runs, or left by realloc) go into the bin of the biggest slot they hold
+        if (block_size > SLAB_MAX_SIZE && block_size <= TCACHE_MAX_SIZE) {
+            bin = block_size / ALIGNMENT;
+        } else if (block_size <= SLAB_MAX_SIZE) {
+            bin = (block_size - WSIZE) / ALIGNMENT;
+        }
+    }
+
+    if (bin != 0) {
+
+        tcache_check();
+
+        if (tcache.counts[bin] >= TCACHE_COUNT) {
+            tcache_flush(bin, TCACHE_BATCH);
+        }
+
+        set_cached_next(bp, tcache.bins[bin]);
+        tcache.bins[bin] = bp;
+        tcache.counts[bin]++;
+        return;
+    }
+
+    if (pthread_mutex_trylock(&arena_mutex) != 0) {
+        defer_frees(bp, bp);
+        return;
+    }
+
+    drain_deferred_frees();
+    heap_free(bp);
+    arena_unlock();
+}
+
+void *
+mm_realloc(void *ptr, size_t size) {
+    STAT(realloc_calls, 1);
+
+    if (ptr == NULL) {
+        return mm_malloc(size);
+    } else if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    } else if (size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // heap_realloc would free a slot, or make one out of a big block that shrinks,
+    // under arena_mutex, where no class lock can be taken. Those are moved here.
+    u8 *bp = (u8 *)ptr;
+    size_t old_size = 0;
+    if (is_slab(bp)) {
+        old_size = slab_run(bp)->slot_size;
+        if (size <= old_size) {
+            STAT(realloc_in_place, 1);
+            return bp;
+        }
+    } else if (size <= SLAB_MAX_SIZE) {
+        // see put_atomic
+        u32 header = __atomic_load_n(header_field(bp), __ATOMIC_RELAXED);
+        if (header & LARGE) {
+            old_size = (header & ~(ALIGNMENT - 1)) - WSIZE;
+        }
+    }
+
+    if (old_size != 0) {
+        u8 *new_bp = mm_malloc(size);
+        if (new_bp == NULL) {
+            return NULL;
+        }
+
+        memcpy(new_bp, bp, (old_size < size) ? old_size : size);
+        mm_free(bp);
+        STAT(realloc_copied, 1);
+
+        return new_bp;
+    }
+
+    arena_lock();
+    void *new_bp = heap_realloc(ptr, size);
+    arena_unlock();
+
+    return new_bp;
+}
+
+#endif
+
+#ifdef MM_STATS
+
+void
+mm_stats(mm_stats_t *out) {
+#ifdef MM_THREAD_SAFE
+    for (u32 class = 0; class < SLAB_CLASSES; class++) {
+        pthread_mutex_lock(&slab_mutexes[class]);
+    }
+    pthread_mutex_lock(&arena_mutex);
+#endif
+
+    // all the fields are size_t counters, other threads may be adding to them
+    for (size_t i = 0; i < sizeof(stats) / sizeof(size_t); i++) {
+        ((size_t *)out)[i] = __atomic_load_n(&((size_t *)&stats)[i], __ATOMIC_RELAXED);
+    }
+
+    out->heap_size = heap_end - heap_start;
+    out->free_bytes = 0;
+    out->free_blocks = 0;
+    out->largest_free_block = 0;
+    memset(out->free_blocks_by_size, 0, sizeof(out->free_blocks_by_size));
+    out->slab_runs = 0;
+    out->slab_slots_used = 0;
+    out->large_free_bytes = 0;
+    out->fast_bin_bytes = 0;
+
+    for (u8 *bp = heap_start + ALIGNMENT; bp < heap_end; bp = next_block_addr(bp)) {
+        u32 size = get_size(header_field(bp));
+
+        if (!is_alloc(header_field(bp))) {
+            out->free_bytes += size;
+            out->free_blocks++;
+            out->free_blocks_by_size[31 - __builtin_clz(size)]++;
+            if (size > out->largest_free_block) {
+                out->largest_free_block = size;
+            }
+        } else if (is_slab(bp)) {
+            out->slab_runs++;
+            out->slab_slots_used += slab_run(bp)->used;
+        } else if (is_large(bp) && is_large_free_page(page_index(bp))) {
+            out->large_free_bytes += size;
+        }
+    }
+
+    for (u32 bin = 0; bin < FAST_BINS; bin++) {
+        for (u8 *bp = from_offset(fast_bins[bin]); bp != NULL; bp = from_offset(*(u32 *)bp)) {
+            out->fast_bin_bytes += bin * ALIGNMENT;
+        }
+    }
+
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_unlock(&arena_mutex);
+    for (u32 class = 0; class < SLAB_CLASSES; class++) {
+        pthread_mutex_unlock(&slab_mutexes[class]);
+    }
+#endif
+}
+
+static void
+json_array(FILE *out, const char *name, const size_t *values, size_t count) {
+    fprintf(out, "  \"%s\": [", name);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, (i == 0) ? "%zu" : ", %zu", values[i]);
+    }
+    fprintf(out, "],\n");
+}
+
+#define JSON_FIELD(name) fprintf(out, "  \"" #name "\": %zu,\n", s.name)
+
+void
+mm_stats_json(FILE *out) {
+    mm_stats_t s;
+    mm_stats(&s);
+
+    fprintf(out, "{\n");
+    JSON_FIELD(malloc_calls);
+    JSON_FIELD(free_calls);
+    JSON_FIELD(realloc_calls);
+    JSON_FIELD(slab_mallocs);
+    JSON_FIELD(large_mallocs);
+    JSON_FIELD(arena_mallocs);
+    json_array(out, "fit_search_length", s.fit_search_length, MM_STATS_BUCKETS);
+    JSON_FIELD(fit_bigger_class);
+    JSON_FIELD(fit_failed);
+    JSON_FIELD(fast_bin_consolidations);
+    JSON_FIELD(extend_heap_calls);
+    JSON_FIELD(extend_heap_bytes);
+    JSON_FIELD(realloc_in_place);
+    JSON_FIELD(realloc_moved);
+    JSON_FIELD(realloc_copied);
+    JSON_FIELD(heap_size);
+    JSON_FIELD(free_bytes);
+    JSON_FIELD(free_blocks);
+    JSON_FIELD(largest_free_block);
+    json_array(out, "free_blocks_by_size", s.free_blocks_by_size, MM_STATS_SIZE_BUCKETS);
+    JSON_FIELD(slab_runs);
+    JSON_FIELD(slab_slots_used);
+    JSON_FIELD(large_free_bytes);
+    fprintf(out, "  \"fast_bin_bytes\": %zu\n}\n", s.fast_bin_bytes);
+}
+
+#endif